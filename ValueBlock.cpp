@@ -1,6 +1,13 @@
 #include "ValueBlock.hpp"
+#include "mapped_file.hpp"
+#include "parse.hpp"
+#include <cstdio>
+#include <cstring>
 #include <istream>
+#include <iterator>
+#include <memory>
 #include <ostream>
+#include <stdexcept>
 
 ValueBlock::ValueBlock(std::string type, std::string id) : type(type), id(id) {}
 
@@ -52,6 +59,18 @@ bool ValueBlock::has<std::vector<int>>(const std::string& name) const
   return has_value(name, livalues);
 }
 
+template <>
+bool ValueBlock::has<SharedArray<pupumath::vec3>>(const std::string& name) const
+{
+  return has_value(name, lvvalues);
+}
+
+template <>
+bool ValueBlock::has<SharedArray<int>>(const std::string& name) const
+{
+  return has_value(name, livalues);
+}
+
 template <typename T>
 T get_value(const std::string& name, const std::map<std::string, T>& map,
             std::string type_name, std::string id)
@@ -97,11 +116,23 @@ Spectrum ValueBlock::get(const std::string& name) const
 template <>
 std::vector<pupumath::vec3> ValueBlock::get(const std::string& name) const
 {
-  return get_value(name, lvvalues, "vector list", id);
+  return get_value(name, lvvalues, "vector list", id).to_vector();
 }
 
 template <>
 std::vector<int> ValueBlock::get(const std::string& name) const
+{
+  return get_value(name, livalues, "int list", id).to_vector();
+}
+
+template <>
+SharedArray<pupumath::vec3> ValueBlock::get(const std::string& name) const
+{
+  return get_value(name, lvvalues, "vector list", id);
+}
+
+template <>
+SharedArray<int> ValueBlock::get(const std::string& name) const
 {
   return get_value(name, livalues, "int list", id);
 }
@@ -114,7 +145,7 @@ void set_value(const std::string& name, T value, std::map<std::string, T>& map,
     throw std::runtime_error("Value " + type_name + " '" + id + "::" + name +
                              "' redefined");
   }
-  map[name] = value;
+  map.emplace(name, std::move(value));
 }
 
 template <>
@@ -147,63 +178,127 @@ void ValueBlock::set(const std::string& name, Spectrum value)
   set_value(name, value, spvalues, "spectrum", id);
 }
 
+template <>
+void ValueBlock::set(const std::string& name, SharedArray<pupumath::vec3> value)
+{
+  set_value(name, std::move(value), lvvalues, "vector list", id);
+}
+
+template <>
+void ValueBlock::set(const std::string& name, SharedArray<int> value)
+{
+  set_value(name, std::move(value), livalues, "int list", id);
+}
+
 template <>
 void ValueBlock::set(const std::string& name, std::vector<pupumath::vec3> value)
 {
-  set_value(name, value, lvvalues, "vector list", id);
+  set(name, SharedArray<pupumath::vec3>(std::move(value)));
 }
 
 template <>
 void ValueBlock::set(const std::string& name, std::vector<int> value)
 {
-  set_value(name, value, livalues, "int list", id);
+  set(name, SharedArray<int>(std::move(value)));
 }
 
-void ValueBlock::read_value(std::istream& istream)
+/// Next whitespace delimited token. Running out of input while reading a
+/// block is an error.
+static std::string read_token(const char*& p, const char* end)
 {
-  std::string name, val;
-  istream >> name >> val;
+  const char* begin;
+  const char* token_end;
+  if (!parse::next_token(p, end, begin, token_end)) {
+    throw std::runtime_error("eof while block open");
+  }
+  return std::string(begin, token_end);
+}
+
+void ValueBlock::read_value(const char*& p, const char* end)
+{
+  std::string name = read_token(p, end);
+  std::string val = read_token(p, end);
+
+  auto invalid_number = [&](const char* at) {
+    const char* begin;
+    const char* token_end;
+    if (!parse::next_token(at, end, begin, token_end)) {
+      throw std::runtime_error("eof while block open");
+    }
+    throw std::runtime_error("Value '" + id + "::" + name +
+                             "' has an invalid number '" +
+                             std::string(begin, token_end) + "'");
+  };
+  // Numbers must be whole tokens.
+  auto read_float = [&](float& v) {
+    parse::skip_space(p, end);
+    const char* start = p;
+    if (!parse::parse_float(p, end, v) || (p < end && !parse::is_space(*p))) {
+      invalid_number(start);
+    }
+  };
+  auto read_count = [&]() {
+    parse::skip_space(p, end);
+    const char* start = p;
+    long long v;
+    if (!parse::parse_int(p, end, v) || (p < end && !parse::is_space(*p)) ||
+        v < 0 || v > 0x7fffffff) {
+      invalid_number(start);
+    }
+    return static_cast<int>(v);
+  };
 
   if ((val[0] >= '0' && val[0] <= '9') || val[0] == '-' || val[0] == '.') {
-    double v = std::stod(val);
+    // Like std::stod, trailing characters after the number are ignored.
+    const char* q = val.data();
+    double v;
+    if (!parse::parse_double(q, val.data() + val.size(), v)) {
+      invalid_number(val.data());
+    }
     set(name, v);
   }
   else if (val == "vec") {
     pupumath::vec3 v;
-    istream >> v[0] >> v[1] >> v[2];
+    read_float(v[0]);
+    read_float(v[1]);
+    read_float(v[2]);
     set(name, v);
   }
   else if (val == "mat") {
     pupumath::mat34 v;
     for (int i = 0; i < 12; ++i) {
-      istream >> v[i];
+      read_float(v[i]);
     }
     set(name, v);
   }
   else if (val == "spectrum") {
     Spectrum v;
     for (int i = 0; i < Spectrum::count; ++i) {
-      istream >> v.samples[i];
+      read_float(v.samples[i]);
     }
     set(name, v);
   }
   else if (val == "veclist") {
-    int count;
-    istream >> count;
-    std::vector<pupumath::vec3> vs(count);
+    std::vector<pupumath::vec3> vs(read_count());
     for (auto& v : vs) {
-      istream >> v[0] >> v[1] >> v[2];
+      read_float(v[0]);
+      read_float(v[1]);
+      read_float(v[2]);
     }
-    set(name, vs);
+    set(name, std::move(vs));
   }
   else if (val == "intlist") {
-    int count;
-    istream >> count;
-    std::vector<int> vs(count);
+    std::vector<int> vs(read_count());
     for (auto& v : vs) {
-      istream >> v;
+      parse::skip_space(p, end);
+      const char* start = p;
+      long long i;
+      if (!parse::parse_int(p, end, i) || (p < end && !parse::is_space(*p))) {
+        invalid_number(start);
+      }
+      v = static_cast<int>(i);
     }
-    set(name, vs);
+    set(name, std::move(vs));
   }
   else {
     set(name, val);
@@ -232,36 +327,30 @@ std::ostream& operator<<(std::ostream& ostream, const ValueBlock& block)
   return ostream;
 }
 
-std::vector<ValueBlock> read_valueblock_file(std::istream& istream)
+std::vector<ValueBlock> read_valueblock_file(const char* p, const char* end)
 {
   ValueBlock* block = nullptr;
   std::vector<ValueBlock> blocks;
 
-  if (!istream.good()) {
-    throw std::runtime_error("attempting to read a bad file");
-  }
-
-  while (true) {
-    std::string token;
-    istream >> token;
-    if (!istream.good()) break;
-
-    if (token == "::") {
+  const char* begin;
+  const char* token_end;
+  while (parse::next_token(p, end, begin, token_end)) {
+    size_t length = token_end - begin;
+    if (length == 2 && begin[0] == ':' && begin[1] == ':') {
       if (!block) {
         throw std::runtime_error("value outside block");
       }
-      block->read_value(istream);
+      block->read_value(p, end);
     }
-    else if (token == ".") {
+    else if (length == 1 && begin[0] == '.') {
       if (!block) {
         throw std::runtime_error("closing mark outside block");
       }
       block = nullptr;
     }
     else {
-      std::string name;
-      istream >> name;
-      blocks.push_back(ValueBlock(token, name));
+      std::string type(begin, token_end);
+      blocks.push_back(ValueBlock(type, read_token(p, end)));
       block = &blocks.back();
     }
   }
@@ -272,3 +361,355 @@ std::vector<ValueBlock> read_valueblock_file(std::istream& istream)
 
   return blocks;
 }
+
+// Binary scene files start with a header
+//
+//   char[8]   magic "alcbscn1"
+//   uint32    0x01020304, to recognize files of the other byte order
+//   uint32    block count
+//
+// followed by the blocks
+//
+//   string    type
+//   string    id
+//   uint32    value count
+//   values:   uint32 kind, string name, payload
+//
+// Strings are a uint32 length and the characters, padded to four bytes.
+// Numbers are doubles aligned to eight bytes. Vectors, matrices and spectra
+// are 3, 12 and 16 floats. Lists are a uint32 count followed by the
+// elements (float triples or int32s), aligned to 16 bytes in the file so
+// that they can be used directly from a mapping.
+
+namespace binary_ns {
+
+const char magic[8] = {'a', 'l', 'c', 'b', 's', 'c', 'n', '1'};
+constexpr uint32_t byte_order_mark = 0x01020304;
+constexpr size_t list_alignment = 16;
+
+enum Kind : uint32_t {
+  kind_string = 1,
+  kind_number,
+  kind_vector,
+  kind_matrix,
+  kind_spectrum,
+  kind_vector_list,
+  kind_int_list,
+};
+
+static_assert(sizeof(pupumath::vec3) == 3 * sizeof(float),
+              "vector lists are stored as float triples");
+static_assert(sizeof(pupumath::mat34) == 12 * sizeof(float),
+              "matrices are stored as 12 floats");
+
+class Writer {
+public:
+  Writer(const std::string& filename)
+      : filename(filename), file(fopen(filename.c_str(), "wb")), offset(0)
+  {
+    if (!file) {
+      throw std::runtime_error("cannot open '" + filename + "' for writing");
+    }
+  }
+  ~Writer()
+  {
+    if (file) fclose(file);
+  }
+
+  void bytes(const void* p, size_t n)
+  {
+    if (n && fwrite(p, 1, n, file) != n) {
+      throw std::runtime_error("cannot write '" + filename + "'");
+    }
+    offset += n;
+  }
+
+  void align(size_t alignment)
+  {
+    static const char zeros[list_alignment] = {};
+    bytes(zeros, (alignment - offset % alignment) % alignment);
+  }
+
+  void u32(uint32_t v) { bytes(&v, sizeof(v)); }
+
+  void string(const std::string& s)
+  {
+    u32(s.size());
+    bytes(s.data(), s.size());
+    align(4);
+  }
+
+  template <typename T>
+  void list(const SharedArray<T>& a)
+  {
+    u32(a.size());
+    align(list_alignment);
+    bytes(a.data(), a.size() * sizeof(T));
+    align(4);
+  }
+
+  void close()
+  {
+    FILE* f = file;
+    file = nullptr;
+    if (fclose(f) != 0) {
+      throw std::runtime_error("cannot write '" + filename + "'");
+    }
+  }
+
+private:
+  std::string filename;
+  FILE* file;
+  size_t offset;
+};
+
+class Reader {
+public:
+  Reader(std::shared_ptr<const MappedFile> file, const std::string& filename)
+      : file(std::move(file)), filename(filename), p(this->file->begin())
+  {
+  }
+
+  const char* take(size_t n)
+  {
+    if (n > size_t(file->end() - p)) fail("unexpected end of file");
+    const char* result = p;
+    p += n;
+    return result;
+  }
+
+  void align(size_t alignment)
+  {
+    size_t offset = p - file->begin();
+    take((alignment - offset % alignment) % alignment);
+  }
+
+  uint32_t u32()
+  {
+    uint32_t v;
+    memcpy(&v, take(sizeof(v)), sizeof(v));
+    return v;
+  }
+
+  std::string string()
+  {
+    uint32_t n = u32();
+    const char* s = take(n);
+    align(4);
+    return std::string(s, n);
+  }
+
+  template <typename T>
+  void floats(T& v, int n)
+  {
+    memcpy(&v, take(n * sizeof(float)), n * sizeof(float));
+  }
+
+  template <typename T>
+  SharedArray<T> list()
+  {
+    uint32_t count = u32();
+    align(list_alignment);
+    if (count > size_t(file->end() - p) / sizeof(T)) {
+      fail("unexpected end of file");
+    }
+    const T* data = reinterpret_cast<const T*>(take(count * sizeof(T)));
+    align(4);
+    return SharedArray<T>(data, count, file);
+  }
+
+  bool at_end() const { return p == file->end(); }
+
+  size_t remaining() const { return file->end() - p; }
+
+  [[noreturn]] void fail(const std::string& message) const
+  {
+    throw std::runtime_error("binary scene '" + filename + "': " + message);
+  }
+
+private:
+  std::shared_ptr<const MappedFile> file;
+  std::string filename;
+  const char* p;
+};
+
+static bool is_binary(const MappedFile& file)
+{
+  return file.size() >= sizeof(magic) &&
+         memcmp(file.begin(), magic, sizeof(magic)) == 0;
+}
+
+static std::vector<ValueBlock> read(std::shared_ptr<const MappedFile> file,
+                                    const std::string& filename)
+{
+  Reader in(std::move(file), filename);
+  in.take(sizeof(magic));
+  if (in.u32() != byte_order_mark) in.fail("wrong byte order");
+
+  // Check the count before allocating for it. Every block takes at least
+  // its type and id lengths and its value count.
+  uint32_t count = in.u32();
+  const size_t min_block_size = 3 * sizeof(uint32_t);
+  if (count > in.remaining() / min_block_size) {
+    in.fail("unexpected end of file");
+  }
+  std::vector<ValueBlock> blocks(count);
+  for (auto& block : blocks) {
+    block.type = in.string();
+    block.id = in.string();
+    uint32_t values = in.u32();
+    for (uint32_t i = 0; i < values; i++) {
+      uint32_t kind = in.u32();
+      std::string name = in.string();
+      switch (kind) {
+      case kind_string:
+        block.set(name, in.string());
+        break;
+      case kind_number: {
+        in.align(8);
+        double v;
+        memcpy(&v, in.take(sizeof(v)), sizeof(v));
+        block.set(name, v);
+        break;
+      }
+      case kind_vector: {
+        pupumath::vec3 v;
+        in.floats(v, 3);
+        block.set(name, v);
+        break;
+      }
+      case kind_matrix: {
+        pupumath::mat34 v;
+        in.floats(v, 12);
+        block.set(name, v);
+        break;
+      }
+      case kind_spectrum: {
+        Spectrum v;
+        in.floats(v.samples, Spectrum::count);
+        block.set(name, v);
+        break;
+      }
+      case kind_vector_list:
+        block.set(name, in.list<pupumath::vec3>());
+        break;
+      case kind_int_list:
+        block.set(name, in.list<int>());
+        break;
+      default:
+        in.fail("unknown value kind " + std::to_string(kind));
+      }
+    }
+  }
+  if (!in.at_end()) in.fail("trailing data");
+  return blocks;
+}
+
+} // namespace binary_ns
+
+std::vector<ValueBlock> read_valueblock_file(const std::string& filename)
+{
+  std::shared_ptr<MappedFile> file;
+  try {
+    file = std::make_shared<MappedFile>(filename);
+  }
+  catch (const std::runtime_error&) {
+    throw std::runtime_error("attempting to read a bad file");
+  }
+  if (binary_ns::is_binary(*file)) {
+    // Mesh arrays are used in place for the whole render.
+    file->advise(MappedFile::random);
+    return binary_ns::read(file, filename);
+  }
+  return read_valueblock_file(file->begin(), file->end());
+}
+
+void write_valueblock_binary(const std::vector<ValueBlock>& blocks,
+                             const std::string& filename)
+{
+  using namespace binary_ns;
+  Writer out(filename);
+  out.bytes(magic, sizeof(magic));
+  out.u32(byte_order_mark);
+  out.u32(blocks.size());
+
+  for (const auto& block : blocks) {
+    out.string(block.type);
+    out.string(block.id);
+    out.u32(block.svalues.size() + block.nvalues.size() +
+            block.vvalues.size() + block.mvalues.size() +
+            block.spvalues.size() + block.lvvalues.size() +
+            block.livalues.size());
+    for (const auto& v : block.svalues) {
+      out.u32(kind_string);
+      out.string(v.first);
+      out.string(v.second);
+    }
+    for (const auto& v : block.nvalues) {
+      out.u32(kind_number);
+      out.string(v.first);
+      out.align(8);
+      out.bytes(&v.second, sizeof(double));
+    }
+    for (const auto& v : block.vvalues) {
+      out.u32(kind_vector);
+      out.string(v.first);
+      out.bytes(&v.second, 3 * sizeof(float));
+    }
+    for (const auto& v : block.mvalues) {
+      out.u32(kind_matrix);
+      out.string(v.first);
+      out.bytes(&v.second, 12 * sizeof(float));
+    }
+    for (const auto& v : block.spvalues) {
+      out.u32(kind_spectrum);
+      out.string(v.first);
+      out.bytes(v.second.samples.data(), Spectrum::count * sizeof(float));
+    }
+    for (const auto& v : block.lvvalues) {
+      out.u32(kind_vector_list);
+      out.string(v.first);
+      out.list(v.second);
+    }
+    for (const auto& v : block.livalues) {
+      out.u32(kind_int_list);
+      out.string(v.first);
+      out.list(v.second);
+    }
+  }
+  out.close();
+}
+
+std::vector<ValueBlock> read_valueblock_file(std::istream& istream)
+{
+  if (!istream.good()) {
+    throw std::runtime_error("attempting to read a bad file");
+  }
+
+  std::string text((std::istreambuf_iterator<char>(istream)),
+                   std::istreambuf_iterator<char>());
+  return read_valueblock_file(text.data(), text.data() + text.size());
+}
+
+std::string percent_decode(const std::string& s)
+{
+  auto hex = [](char c) -> int {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  };
+
+  std::string result;
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '%' && i + 2 < s.size() && hex(s[i + 1]) >= 0 &&
+        hex(s[i + 2]) >= 0) {
+      result += char(hex(s[i + 1]) * 16 + hex(s[i + 2]));
+      i += 2;
+    }
+    else {
+      result += s[i];
+    }
+  }
+  return result;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "pupumath_struct.hpp"
+#include "shared_array.hpp"
 #include "spectrum.hpp"
 #include <iosfwd> // forward declare std::istream/ostream
 #include <map>
@@ -15,13 +16,15 @@ struct ValueBlock {
   std::map<std::string, pupumath::vec3> vvalues;
   std::map<std::string, pupumath::mat34> mvalues;
   std::map<std::string, Spectrum> spvalues;
-  std::map<std::string, std::vector<pupumath::vec3>> lvvalues;
-  std::map<std::string, std::vector<int>> livalues;
+  /// Lists may point into a memory mapped binary scene file.
+  std::map<std::string, SharedArray<pupumath::vec3>> lvvalues;
+  std::map<std::string, SharedArray<int>> livalues;
 
   ValueBlock() {}
   ValueBlock(std::string type, std::string id);
 
-  void read_value(std::istream& istream);
+  /// Parse one `name value` pair from the text at `p`, advancing `p`.
+  void read_value(const char*& p, const char* end);
 
   template <typename T>
   bool has(const std::string& name) const;
@@ -33,4 +36,20 @@ struct ValueBlock {
 
 std::ostream& operator<<(std::ostream& ostream, const ValueBlock& block);
 
+/// Parse the blocks in the text [begin, end).
+std::vector<ValueBlock> read_valueblock_file(const char* begin,
+                                             const char* end);
+/// Parse a scene file. The file is memory mapped rather than read. Binary
+/// scene files are recognized by their header, and their lists are used
+/// from the mapping without copying.
+std::vector<ValueBlock> read_valueblock_file(const std::string& filename);
 std::vector<ValueBlock> read_valueblock_file(std::istream& istream);
+
+/// Write the blocks in the binary scene format, which read_valueblock_file
+/// maps and uses in place.
+void write_valueblock_binary(const std::vector<ValueBlock>& blocks,
+                             const std::string& filename);
+
+/// Decode %XX escapes. String values can't contain whitespace, so file names
+/// in scene files are percent-encoded.
+std::string percent_decode(const std::string& s);
@@ -0,0 +1,173 @@
+#include "bvh.hpp"
+#include <algorithm>
+using namespace pupumath;
+
+namespace bvh_ns {
+
+struct BuildPrimitive {
+  Bounds bounds;
+  vec3 centroid;
+  int index;
+};
+
+// Leaves hold at most this many primitives even if they can't be separated.
+constexpr int max_degenerate_leaf = 255;
+// Beyond this depth subtrees are split by counts, which bounds the total
+// depth well below the 64 entry traversal stack.
+constexpr int max_depth = 32;
+constexpr int sah_bins = 16;
+
+struct Builder {
+  std::vector<BuildPrimitive>& prims;
+  int max_leaf_size;
+  std::vector<BvhNode> nodes;
+  std::vector<int> indices;
+
+  /// Build the subtree for prims[begin, end) and return its node index.
+  int build(int begin, int end, int depth)
+  {
+    int node_index = nodes.size();
+    nodes.push_back({});
+
+    Bounds bounds;
+    Bounds centroid_bounds;
+    for (int i = begin; i < end; i++) {
+      bounds = merge(bounds, prims[i].bounds);
+      centroid_bounds = merge(centroid_bounds, prims[i].centroid);
+    }
+
+    int count = end - begin;
+    int axis = max_extent_axis(centroid_bounds);
+    bool degenerate = centroid_bounds.max[axis] == centroid_bounds.min[axis];
+    if (count == 1 || (degenerate && count <= max_degenerate_leaf) ||
+        (depth >= max_depth && count <= max_leaf_size)) {
+      return make_leaf(node_index, bounds, begin, end);
+    }
+
+    // Binned surface area heuristic along the longest centroid axis. Deep
+    // trees are split by counts instead to keep the traversal stack bounded.
+    auto first = prims.begin() + begin;
+    auto last = prims.begin() + end;
+    auto split = first;
+    if (depth < max_depth && !degenerate) {
+      float lo = centroid_bounds.min[axis];
+      float scale = sah_bins / (centroid_bounds.max[axis] - lo);
+      auto bin_of = [=](const BuildPrimitive& p) {
+        return std::min(sah_bins - 1, int((p.centroid[axis] - lo) * scale));
+      };
+
+      Bounds bin_bounds[sah_bins];
+      int bin_count[sah_bins] = {};
+      for (auto it = first; it != last; ++it) {
+        int b = bin_of(*it);
+        bin_bounds[b] = merge(bin_bounds[b], it->bounds);
+        bin_count[b]++;
+      }
+
+      // Sweep from the right to get the cost of everything right of each
+      // split plane, then from the left to find the cheapest plane.
+      float right_area[sah_bins];
+      int right_count[sah_bins];
+      Bounds acc;
+      int n = 0;
+      for (int b = sah_bins - 1; b > 0; b--) {
+        acc = merge(acc, bin_bounds[b]);
+        n += bin_count[b];
+        right_area[b] = surface_area(acc);
+        right_count[b] = n;
+      }
+
+      float best_cost = HUGE_VALF;
+      int best_split = 1;
+      acc = Bounds();
+      n = 0;
+      for (int b = 1; b < sah_bins; b++) {
+        acc = merge(acc, bin_bounds[b - 1]);
+        n += bin_count[b - 1];
+        if (n == 0 || right_count[b] == 0) continue;
+        float cost = n * surface_area(acc) + right_count[b] * right_area[b];
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_split = b;
+        }
+      }
+
+      // Relative cost of traversing one node vs. intersecting a primitive.
+      constexpr float traversal_cost = 0.5f;
+      float leaf_cost = count;
+      float split_cost =
+          traversal_cost + best_cost / std::max(surface_area(bounds), 1e-30f);
+      if (count <= max_leaf_size && leaf_cost <= split_cost) {
+        return make_leaf(node_index, bounds, begin, end);
+      }
+
+      split = std::partition(first, last, [=](const BuildPrimitive& p) {
+        return bin_of(p) < best_split;
+      });
+    }
+    if (split == first || split == last) {
+      split = first + count / 2;
+      std::nth_element(first, split, last,
+                       [=](const BuildPrimitive& a, const BuildPrimitive& b) {
+                         return a.centroid[axis] < b.centroid[axis];
+                       });
+    }
+
+    int middle = split - prims.begin();
+    build(begin, middle, depth + 1);
+    int second = build(middle, end, depth + 1);
+
+    BvhNode& node = nodes[node_index];
+    node.bounds = bounds;
+    node.offset = second;
+    node.count = 0;
+    node.axis = axis;
+    return node_index;
+  }
+
+  int make_leaf(int node_index, const Bounds& bounds, int begin, int end)
+  {
+    BvhNode& node = nodes[node_index];
+    node.bounds = bounds;
+    node.offset = indices.size();
+    node.count = end - begin;
+    node.axis = 0;
+    for (int i = begin; i < end; i++) {
+      indices.push_back(prims[i].index);
+    }
+    return node_index;
+  }
+};
+
+} // namespace bvh_ns
+
+using namespace bvh_ns;
+
+Bvh::BuildParameters Bvh::build_parameters(int max_leaf_size)
+{
+  return {max_leaf_size, max_degenerate_leaf, max_depth, sah_bins};
+}
+
+Bvh::Bvh(const std::vector<Bounds>& primitive_bounds, int max_leaf_size)
+{
+  if (primitive_bounds.empty()) return;
+
+  std::vector<BuildPrimitive> prims;
+  prims.reserve(primitive_bounds.size());
+  for (size_t i = 0; i < primitive_bounds.size(); i++) {
+    // Pad the boxes slightly so that flat primitives (axis aligned quads)
+    // don't produce degenerate slabs.
+    Bounds b = primitive_bounds[i];
+    vec3 d = extent(b);
+    float pad = 1e-4f * std::max(d.x, std::max(d.y, d.z)) + 1e-6f;
+    b = Bounds(b.min - vec3(pad), b.max + vec3(pad));
+    prims.push_back({b, centroid(b), static_cast<int>(i)});
+  }
+
+  Builder builder{prims, max_leaf_size, {}, {}};
+  builder.nodes.reserve(2 * prims.size());
+  builder.indices.reserve(prims.size());
+  builder.build(0, prims.size(), 0);
+  nodes = std::move(builder.nodes);
+  indices = std::move(builder.indices);
+}
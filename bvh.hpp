@@ -0,0 +1,188 @@
+#pragma once
+#include "packet.hpp"
+#include "pupumath.hpp"
+#include "ray.hpp"
+#include "shared_array.hpp"
+#include <cstdint>
+#include <vector>
+
+/// Node of a flattened BVH. The first child of an interior node immediately
+/// follows it, `offset` is the index of the second child. For leaves `offset`
+/// is the first entry in `Bvh::indices` and `count` the number of primitives.
+struct BvhNode {
+  pupumath::Bounds bounds;
+  int32_t offset;
+  uint16_t count;
+  uint8_t axis;
+  uint8_t pad;
+};
+
+/// Bounding volume hierarchy over an indexed set of primitives.
+class Bvh {
+public:
+  SharedArray<BvhNode> nodes;
+  /// Primitive indices in leaf order.
+  SharedArray<int> indices;
+
+  Bvh() {}
+  Bvh(const std::vector<pupumath::Bounds>& primitive_bounds,
+      int max_leaf_size = 4);
+  /// Use an already built hierarchy, for example one loaded from a file.
+  Bvh(SharedArray<BvhNode> nodes, SharedArray<int> indices)
+      : nodes(std::move(nodes)), indices(std::move(indices))
+  {
+  }
+
+  bool empty() const { return nodes.empty(); }
+
+  /// Everything besides the primitives that decides the hierarchy built, for
+  /// keying stored hierarchies.
+  struct BuildParameters {
+    int32_t max_leaf_size;
+    int32_t max_degenerate_leaf;
+    int32_t max_depth;
+    int32_t sah_bins;
+  };
+  static BuildParameters build_parameters(int max_leaf_size);
+
+  /// Visit the primitives whose bounds the ray might hit, nearest first.
+  /// `intersect(index)` tests primitive `index`, shrinks `ray.tmax` on a hit
+  /// and returns whether it hit. Returns true if any primitive was hit.
+  template <typename F>
+  bool traverse(const Ray& ray, F&& intersect) const;
+
+  /// traverse() for the `active` lanes of a packet. The nodes are visited in
+  /// the order of the first active lane. `intersect(index, lanes)` tests
+  /// primitive `index` for the given lanes, shrinks their `ray.tmax` on a
+  /// hit and returns the lanes that hit. Returns the lanes that hit anything.
+  template <typename F>
+  mask4 traverse4(const RayPacket& ray, mask4 active, F&& intersect) const;
+};
+
+inline bool intersect_bounds(const pupumath::Bounds& b,
+                             const pupumath::vec3& origin,
+                             const pupumath::vec3& inv_dir, float tmax)
+{
+  float t0 = 0.0f;
+  float t1 = tmax;
+  for (int a = 0; a < 3; a++) {
+    float tnear = (b.min[a] - origin[a]) * inv_dir[a];
+    float tfar = (b.max[a] - origin[a]) * inv_dir[a];
+    if (tnear > tfar) std::swap(tnear, tfar);
+    // Guard against rounding error in the slab distances. The comparisons are
+    // written so that NaNs (ray parallel to and inside a flat slab) pass.
+    tfar *= 1.0000004f;
+    t0 = tnear > t0 ? tnear : t0;
+    t1 = tfar < t1 ? tfar : t1;
+    if (t0 > t1) return false;
+  }
+  return true;
+}
+
+/// intersect_bounds() for four rays. The lanes behave exactly like the
+/// scalar version, NaNs included.
+inline mask4 intersect_bounds4(const pupumath::Bounds& b, const vec3x4& origin,
+                               const vec3x4& inv_dir, float4 tmax)
+{
+  float4 t0(0.0f);
+  float4 t1 = tmax;
+  for (int a = 0; a < 3; a++) {
+    float4 tnear = (float4(b.min[a]) - origin[a]) * inv_dir[a];
+    float4 tfar = (float4(b.max[a]) - origin[a]) * inv_dir[a];
+    mask4 swap = tnear > tfar;
+    float4 t = select(swap, tfar, tnear);
+    tfar = select(swap, tnear, tfar) * 1.0000004f;
+    tnear = t;
+    t0 = select(tnear > t0, tnear, t0);
+    t1 = select(tfar < t1, tfar, t1);
+  }
+  // t0 only grows and t1 only shrinks, so one test at the end suffices.
+  return ~(t0 > t1);
+}
+
+template <typename F>
+bool Bvh::traverse(const Ray& ray, F&& intersect) const
+{
+  if (nodes.empty()) return false;
+
+  using pupumath::vec3;
+  const vec3 inv_dir{1 / ray.direction.x, 1 / ray.direction.y,
+                     1 / ray.direction.z};
+  const bool dir_is_neg[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+
+  bool hit = false;
+  int stack[64];
+  int stack_size = 0;
+  int current = 0;
+  while (true) {
+    const BvhNode& node = nodes[current];
+    if (intersect_bounds(node.bounds, ray.origin, inv_dir, ray.tmax)) {
+      if (node.count > 0) {
+        for (int i = 0; i < node.count; i++) {
+          if (intersect(indices[node.offset + i])) hit = true;
+        }
+        if (stack_size == 0) break;
+        current = stack[--stack_size];
+      }
+      else if (dir_is_neg[node.axis]) {
+        stack[stack_size++] = current + 1;
+        current = node.offset;
+      }
+      else {
+        stack[stack_size++] = node.offset;
+        current = current + 1;
+      }
+    }
+    else {
+      if (stack_size == 0) break;
+      current = stack[--stack_size];
+    }
+  }
+  return hit;
+}
+
+template <typename F>
+mask4 Bvh::traverse4(const RayPacket& ray, mask4 active, F&& intersect) const
+{
+  mask4 hit(false);
+  if (nodes.empty() || !active.any()) return hit;
+
+  const float4 one(1.0f);
+  const vec3x4 inv_dir{one / ray.direction.x, one / ray.direction.y,
+                       one / ray.direction.z};
+  int lead = 0;
+  while (!active[lead]) lead++;
+  const bool dir_is_neg[3] = {inv_dir.x[lead] < 0, inv_dir.y[lead] < 0,
+                              inv_dir.z[lead] < 0};
+
+  int stack[64];
+  int stack_size = 0;
+  int current = 0;
+  while (true) {
+    const BvhNode& node = nodes[current];
+    mask4 lanes =
+        intersect_bounds4(node.bounds, ray.origin, inv_dir, ray.tmax) & active;
+    if (lanes.any()) {
+      if (node.count > 0) {
+        for (int i = 0; i < node.count; i++) {
+          hit = hit | intersect(indices[node.offset + i], lanes);
+        }
+        if (stack_size == 0) break;
+        current = stack[--stack_size];
+      }
+      else if (dir_is_neg[node.axis]) {
+        stack[stack_size++] = current + 1;
+        current = node.offset;
+      }
+      else {
+        stack[stack_size++] = node.offset;
+        current = current + 1;
+      }
+    }
+    else {
+      if (stack_size == 0) break;
+      current = stack[--stack_size];
+    }
+  }
+  return hit;
+}
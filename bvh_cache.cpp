@@ -0,0 +1,182 @@
+#include "bvh_cache.hpp"
+#include "mapped_file.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+
+static_assert(std::is_trivially_copyable<BvhNode>::value,
+              "nodes are written and mapped as raw bytes");
+
+namespace bvh_cache_ns {
+
+// Cache files are a header followed by the nodes and the indices. Bump the
+// magic when the node layout or the builder's code changes; its parameters
+// are part of the key.
+const char magic[8] = {'a', 'l', 'c', 'b', 'v', 'h', '0', '1'};
+
+struct Header {
+  char magic[8];
+  uint64_t key;
+  uint32_t node_count;
+  uint32_t index_count;
+  uint64_t pad;
+};
+
+static_assert(sizeof(Header) % 16 == 0, "nodes follow the header aligned");
+
+inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+constexpr uint64_t prime1 = 0x9e3779b185ebca87ull;
+constexpr uint64_t prime2 = 0xc2b2ae3d27d4eb4full;
+constexpr uint64_t prime3 = 0x165667b19e3779f9ull;
+
+/// Check that traversing the hierarchy stays within the arrays, terminates
+/// and fits the traversal stack.
+static bool is_valid(const Bvh& bvh, size_t primitive_count)
+{
+  size_t n = bvh.nodes.size();
+  std::vector<int> depth(n, 0);
+  for (size_t i = 0; i < n; i++) {
+    const BvhNode& node = bvh.nodes[i];
+    if (node.count > 0) {
+      if (node.offset < 0 ||
+          size_t(node.offset) + node.count > bvh.indices.size()) {
+        return false;
+      }
+    }
+    else {
+      // Children always come after their parent.
+      if (i + 1 >= n || node.offset <= int64_t(i) + 1 ||
+          size_t(node.offset) >= n || node.axis > 2) {
+        return false;
+      }
+      int d = depth[i] + 1;
+      if (d >= 64) return false;
+      depth[i + 1] = std::max(depth[i + 1], d);
+      depth[node.offset] = std::max(depth[node.offset], d);
+    }
+  }
+  for (int index : bvh.indices) {
+    if (index < 0 || size_t(index) >= primitive_count) return false;
+  }
+  return true;
+}
+
+} // namespace bvh_cache_ns
+
+using namespace bvh_cache_ns;
+
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed)
+{
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  uint64_t h = seed + prime3 + size * prime1;
+  for (; size >= 8; size -= 8, p += 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    h ^= rotl(w * prime2, 31) * prime1;
+    h = rotl(h, 27) * prime1 + prime3;
+  }
+  for (; size > 0; size--, p++) {
+    h ^= *p * prime3;
+    h = rotl(h, 11) * prime1;
+  }
+  // Final avalanche from MurmurHash3.
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+BvhCache::BvhCache(const std::string& directory)
+    : directory(directory), usable(true)
+{
+}
+
+std::string BvhCache::path(uint64_t key) const
+{
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.bvh",
+           static_cast<unsigned long long>(key));
+  return directory + "/" + name;
+}
+
+bool BvhCache::load(uint64_t key, size_t primitive_count, Bvh& bvh) const
+{
+  if (!usable) return false;
+
+  std::shared_ptr<MappedFile> file;
+  try {
+    // The hierarchy is used in place and traversed in no particular order.
+    file = std::make_shared<MappedFile>(path(key), MappedFile::random);
+  }
+  catch (const std::runtime_error&) {
+    return false;
+  }
+
+  Header header;
+  if (file->size() < sizeof(header)) return false;
+  memcpy(&header, file->begin(), sizeof(header));
+  size_t nodes_size = size_t(header.node_count) * sizeof(BvhNode);
+  size_t indices_size = size_t(header.index_count) * sizeof(int);
+  if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.key != key ||
+      file->size() != sizeof(header) + nodes_size + indices_size) {
+    return false;
+  }
+
+  const char* p = file->begin() + sizeof(header);
+  Bvh loaded(SharedArray<BvhNode>(reinterpret_cast<const BvhNode*>(p),
+                                  header.node_count, file),
+             SharedArray<int>(reinterpret_cast<const int*>(p + nodes_size),
+                              header.index_count, file));
+  if (!is_valid(loaded, primitive_count)) return false;
+  bvh = loaded;
+  return true;
+}
+
+void BvhCache::store(uint64_t key, const Bvh& bvh)
+{
+  if (!usable) return;
+  if (mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "warning: can't create BVH cache '%s': %s\n",
+            directory.c_str(), strerror(errno));
+    usable = false;
+    return;
+  }
+
+  // Write under a temporary name and rename, so that concurrent renders
+  // never see a partial file.
+  std::string final_path = path(key);
+  std::string temp_path = final_path + ".tmp" + std::to_string(getpid());
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    fprintf(stderr, "warning: can't write BVH cache '%s': %s\n",
+            temp_path.c_str(), strerror(errno));
+    return;
+  }
+
+  Header header = {};
+  memcpy(header.magic, magic, sizeof(magic));
+  header.key = key;
+  header.node_count = bvh.nodes.size();
+  header.index_count = bvh.indices.size();
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(bvh.nodes.data(), sizeof(BvhNode), bvh.nodes.size(), f) ==
+                bvh.nodes.size() &&
+            fwrite(bvh.indices.data(), sizeof(int), bvh.indices.size(), f) ==
+                bvh.indices.size();
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(temp_path.c_str(), final_path.c_str()) != 0) {
+    fprintf(stderr, "warning: can't write BVH cache '%s'\n",
+            final_path.c_str());
+    remove(temp_path.c_str());
+  }
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "bvh.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/// 64 bit hash of a byte range, for content keys. Not cryptographic.
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 0);
+
+/// Directory of built hierarchies, one file per content key. Files are
+/// memory mapped and used in place. A key that doesn't match anything (or
+/// a damaged file) just means building again, so stale entries are
+/// harmless; changed geometry gets a new key.
+class BvhCache {
+public:
+  explicit BvhCache(const std::string& directory);
+
+  /// Return the hierarchy stored for `key`, or build it with `build()` and
+  /// store it. `primitive_count` is used to validate loaded files.
+  template <typename F>
+  Bvh get(uint64_t key, size_t primitive_count, F&& build)
+  {
+    Bvh bvh;
+    if (load(key, primitive_count, bvh)) return bvh;
+    bvh = build();
+    store(key, bvh);
+    return bvh;
+  }
+
+private:
+  std::string directory;
+  bool usable;
+
+  std::string path(uint64_t key) const;
+  bool load(uint64_t key, size_t primitive_count, Bvh& bvh) const;
+  void store(uint64_t key, const Bvh& bvh);
+};
@@ -1,6 +1,7 @@
 #include "camera.hpp"
 #include "pupumath.hpp"
 #include "ValueBlock.hpp"
+#include <stdexcept>
 using namespace pupumath;
 
 namespace camera_ns {
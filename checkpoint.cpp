@@ -0,0 +1,142 @@
+#include "checkpoint.hpp"
+#include "bvh_cache.hpp"
+#include "framebuffer.hpp"
+#include "mapped_file.hpp"
+#include "render.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <unistd.h>
+
+static_assert(std::is_trivially_copyable<Pixel>::value &&
+                  std::is_trivially_copyable<AuxPixel>::value,
+              "pixels are written as raw bytes");
+
+namespace checkpoint_ns {
+
+// A header followed by the framebuffer pixels and then the auxiliary pixels,
+// both in row order.
+const char magic[8] = {'a', 'l', 'c', 'c', 'k', 'p', 't', '5'};
+constexpr uint32_t byte_order_mark = 0x01020304;
+
+struct Header {
+  char magic[8];
+  uint32_t byte_order_mark;
+  int32_t width;
+  int32_t height;
+  int32_t samples;
+  int32_t samples_done;
+  int32_t rr_min_depth;
+  float rr_max_survival;
+  float filter_radius;
+  char sampler[28];
+  char filter[28];
+  uint64_t scene_hash;
+};
+
+static_assert(sizeof(Header) == 104, "header layout is part of the format");
+
+static Header make_header(const RenderSettings& settings, uint64_t scene_hash,
+                          int samples_done)
+{
+  Header header = {};
+  memcpy(header.magic, magic, sizeof(magic));
+  header.byte_order_mark = byte_order_mark;
+  header.width = settings.width;
+  header.height = settings.height;
+  header.samples = settings.samples;
+  header.samples_done = samples_done;
+  header.rr_min_depth = settings.integrator.rr_min_depth;
+  header.rr_max_survival = settings.integrator.rr_max_survival;
+  header.filter_radius = settings.filter_radius;
+  strncpy(header.sampler, settings.sampler.c_str(), sizeof(header.sampler) - 1);
+  strncpy(header.filter, settings.filter.c_str(), sizeof(header.filter) - 1);
+  header.scene_hash = scene_hash;
+  return header;
+}
+
+} // namespace checkpoint_ns
+
+using namespace checkpoint_ns;
+
+void write_checkpoint(const std::string& filename,
+                      const RenderSettings& settings, uint64_t scene_hash,
+                      int samples_done, const Framebuffer& framebuffer)
+{
+  // Write under a temporary name and rename, so that being stopped halfway
+  // leaves the previous checkpoint intact.
+  std::string temp = filename + ".tmp" + std::to_string(getpid());
+  FILE* f = fopen(temp.c_str(), "wb");
+  if (!f) {
+    throw std::runtime_error("cannot open '" + temp + "' for writing: " +
+                             strerror(errno));
+  }
+  Header header = make_header(settings, scene_hash, samples_done);
+  size_t count = size_t(framebuffer.xres) * framebuffer.yres;
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(framebuffer.pixels.get(), sizeof(Pixel), count, f) ==
+                count &&
+            fwrite(framebuffer.aux.get(), sizeof(AuxPixel), count, f) == count;
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(temp.c_str(), filename.c_str()) != 0) {
+    remove(temp.c_str());
+    throw std::runtime_error("cannot write checkpoint '" + filename + "'");
+  }
+}
+
+int read_checkpoint(const std::string& filename,
+                    const RenderSettings& settings, uint64_t scene_hash,
+                    Framebuffer& framebuffer)
+{
+  MappedFile file(filename);
+  auto error = [&](const std::string& what) {
+    return std::runtime_error("checkpoint '" + filename + "': " + what);
+  };
+
+  Header header;
+  if (file.size() < sizeof(header)) throw error("truncated");
+  memcpy(&header, file.begin(), sizeof(header));
+  if (memcmp(header.magic, magic, sizeof(magic)) != 0) {
+    throw error("not a checkpoint");
+  }
+  if (header.byte_order_mark != byte_order_mark) {
+    throw error("written on a machine with different byte order");
+  }
+
+  Header expected = make_header(settings, scene_hash, header.samples_done);
+  if (header.scene_hash != expected.scene_hash) {
+    throw error("written for a different scene, or the scene file changed");
+  }
+  if (memcmp(&header, &expected, sizeof(header)) != 0) {
+    throw error("written with different settings (" +
+                std::to_string(header.width) + "x" +
+                std::to_string(header.height) + ", " +
+                std::to_string(header.samples) + " samples, sampler '" +
+                std::string(header.sampler,
+                            strnlen(header.sampler, sizeof(header.sampler))) +
+                "')");
+  }
+  if (header.samples_done < 0 || header.samples_done > header.samples) {
+    throw error("invalid progress");
+  }
+
+  size_t count = size_t(framebuffer.xres) * framebuffer.yres;
+  if (file.size() !=
+      sizeof(header) + count * (sizeof(Pixel) + sizeof(AuxPixel))) {
+    throw error("wrong size");
+  }
+  const char* p = file.begin() + sizeof(header);
+  memcpy(framebuffer.pixels.get(), p, count * sizeof(Pixel));
+  memcpy(framebuffer.aux.get(), p + count * sizeof(Pixel),
+         count * sizeof(AuxPixel));
+  return header.samples_done;
+}
+
+uint64_t scene_file_hash(const std::string& filename)
+{
+  MappedFile file(filename);
+  return hash_bytes(file.begin(), file.size());
+}
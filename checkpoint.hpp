@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+class Framebuffer;
+struct RenderSettings;
+
+/// Save the accumulated framebuffer and the number of samples per pixel in
+/// it, so that the render can be continued by another process. The file is
+/// replaced atomically.
+/// `scene_hash` identifies the scene, see scene_file_hash().
+void write_checkpoint(const std::string& filename,
+                      const RenderSettings& settings, uint64_t scene_hash,
+                      int samples_done, const Framebuffer& framebuffer);
+
+/// Load a checkpoint into the framebuffer and return the number of samples
+/// per pixel it holds. Throws if the file is damaged or was written for
+/// another scene or with settings that would give a different image.
+int read_checkpoint(const std::string& filename,
+                    const RenderSettings& settings, uint64_t scene_hash,
+                    Framebuffer& framebuffer);
+
+/// Hash of the contents of a scene file, to tell whether a checkpoint
+/// belongs to it. Files that the scene refers to, such as PLY meshes, are
+/// not included.
+uint64_t scene_file_hash(const std::string& filename);
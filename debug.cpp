@@ -3,7 +3,7 @@
 #include <cstdio>
 
 
-debug_t debug;
+thread_local debug_t debug;
 
 debug_t::debug_t()
     : enabled(false), nest_level(0), paths(0), rays(0), total_rays(0),
@@ -11,6 +11,20 @@ debug_t::debug_t()
 {
 }
 
+void debug_t::merge(const debug_t& other)
+{
+  paths += other.paths;
+  total_rays += other.total_rays;
+  min_path_length = std::min(min_path_length, other.min_path_length);
+  if (other.max_path_length > max_path_length) {
+    path_lengths.resize(other.max_path_length + 1, 0);
+    max_path_length = other.max_path_length;
+  }
+  for (size_t i = 0; i < other.path_lengths.size(); i++) {
+    path_lengths[i] += other.path_lengths[i];
+  }
+}
+
 void debug_t::begin_path()
 {
   ++paths;
@@ -28,6 +42,12 @@ void debug_t::end_path()
   ++path_lengths[rays];
 }
 
+void debug_t::end_path(int segments)
+{
+  rays = segments;
+  end_path();
+}
+
 void debug_t::ray(const Ray& ray)
 {
   ++rays;
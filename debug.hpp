@@ -13,8 +13,13 @@ struct debug_t {
   std::vector<int> path_lengths;
 
   debug_t();
+  /// Accumulate the statistics of another (per-thread) instance.
+  void merge(const debug_t&);
   void begin_path();
   void end_path();
+  /// End a path that counted its own segments, because it was traced
+  /// interleaved with others.
+  void end_path(int segments);
   void ray(const Ray&);
   void miss();
   void hit(const Ray&);
@@ -31,9 +36,5 @@ struct debug_t {
   }
 };
 
-extern debug_t debug;
-
-struct DebugNester {
-  DebugNester() { debug.nest_level++; }
-  ~DebugNester() { debug.nest_level--; }
-};
+// Each render thread collects its own statistics.
+extern thread_local debug_t debug;
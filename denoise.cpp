@@ -0,0 +1,201 @@
+#include "denoise.hpp"
+#include "framebuffer.hpp"
+#include "simd.hpp"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+namespace denoise_ns {
+
+/// B3 spline, the usual à-trous kernel. Every iteration doubles the distance
+/// between its taps.
+const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+constexpr int iterations = 5;
+/// Border around the image, wide enough for the last iteration's taps, so
+/// that the inner loop needs no bounds checks.
+constexpr int pad = 2 << (iterations - 1);
+
+// Edge stopping. The weight of a neighbour is exp(-sum of the terms), and
+// each term is 1 when the difference reaches the given tolerance.
+/// Brightness, in standard deviations. The smaller variance of the two pixels
+/// counts, so that a noisy pixel doesn't smear over a clean edge such as the
+/// outline of a light.
+const float sigma_luminance = 2;
+/// Squared distance between normals; 1/64 is about 7 degrees.
+const float sigma_normal = 1.0f / 64;
+/// Depth, relative to the centre pixel's depth, per pixel of distance.
+const float sigma_depth = 0.01f;
+/// Albedo, per channel.
+const float sigma_albedo = 0.2f;
+/// Depth given to pixels where every ray escaped, so that they only blend
+/// with each other.
+const float background_depth = 1e9f;
+
+enum { red, green, blue, variance, colour_planes };
+enum { albedo_r, albedo_g, albedo_b, normal_x, normal_y, normal_z, depth, mask,
+       guide_planes };
+
+/// Planes of floats, one per channel, with the border around the image. Four
+/// horizontally adjacent pixels load into one float4. The border is zero,
+/// and in particular has a zero mask.
+struct Planes {
+  int stride, size;
+  std::vector<float> data;
+
+  Planes(int width, int height, int planes)
+      : stride((width + 3) / 4 * 4 + 2 * pad),
+        size(stride * (height + 2 * pad)), data(size_t(size) * planes, 0.0f)
+  {
+  }
+
+  float* at(int plane, int x, int y)
+  {
+    return &data[size_t(plane) * size + (y + pad) * stride + x + pad];
+  }
+  const float* at(int plane, int x, int y) const
+  {
+    return &data[size_t(plane) * size + (y + pad) * stride + x + pad];
+  }
+};
+
+static float4 luminance(float4 r, float4 g, float4 b)
+{
+  return r * 0.2126f + g * 0.7152f + b * 0.0722f;
+}
+
+/// One à-trous iteration over rows [y0, y1) with taps `step` pixels apart.
+/// Runs on a thread of its own.
+static void filter_rows(const Planes& guide, const Planes& in, Planes& out,
+                        int width, int y0, int y1, int step)
+{
+  // Weights across edges are tiny.
+  flush_denormals();
+  for (int y = y0; y < y1; y++) {
+    for (int x = 0; x < width; x += 4) {
+      auto centre = [&](const Planes& p, int plane) {
+        return float4::load(p.at(plane, x, y));
+      };
+      float4 r = centre(in, red), g = centre(in, green), b = centre(in, blue);
+      float4 l = luminance(r, g, b);
+      float4 ar = centre(guide, albedo_r), ag = centre(guide, albedo_g),
+             ab = centre(guide, albedo_b);
+      float4 nx = centre(guide, normal_x), ny = centre(guide, normal_y),
+             nz = centre(guide, normal_z);
+      float4 z = centre(guide, depth);
+
+      // The variance of a single pixel is itself noisy, so blur it a bit
+      // before deriving the brightness tolerance from it.
+      float4 v(0.0f);
+      for (int j = -1; j <= 1; j++) {
+        for (int i = -1; i <= 1; i++) {
+          float k = (i == 0 ? 0.5f : 0.25f) * (j == 0 ? 0.5f : 0.25f);
+          v = v + float4::load(in.at(variance, x + i, y + j)) * k;
+        }
+      }
+      float4 inv_z = float4(1.0f) / (z * sigma_depth + float4(1e-4f));
+
+      float4 sum_r(0.0f), sum_g(0.0f), sum_b(0.0f), sum_v(0.0f), sum_w(0.0f);
+      for (int j = -2; j <= 2; j++) {
+        for (int i = -2; i <= 2; i++) {
+          int tx = x + i * step, ty = y + j * step;
+          auto tap = [&](const Planes& p, int plane) {
+            return float4::load(p.at(plane, tx, ty));
+          };
+          float4 tr = tap(in, red), tg = tap(in, green), tb = tap(in, blue);
+          float4 dl = luminance(tr, tg, tb) - l;
+          float4 dar = tap(guide, albedo_r) - ar;
+          float4 dag = tap(guide, albedo_g) - ag;
+          float4 dab = tap(guide, albedo_b) - ab;
+          float4 dnx = tap(guide, normal_x) - nx;
+          float4 dny = tap(guide, normal_y) - ny;
+          float4 dnz = tap(guide, normal_z) - nz;
+          float4 dz = tap(guide, depth) - z;
+
+          float distance = float(step * std::max(std::abs(i), std::abs(j)));
+          float4 e = dl * dl / (min(v, tap(in, variance)) *
+                                    (sigma_luminance * sigma_luminance) +
+                                float4(1e-6f)) +
+                     (dnx * dnx + dny * dny + dnz * dnz) *
+                         (1 / sigma_normal) +
+                     abs(dz) * inv_z * (1 / std::max(distance, 1.0f)) +
+                     (dar * dar + dag * dag + dab * dab) *
+                         (1 / (sigma_albedo * sigma_albedo));
+          float4 w =
+              exp_neg(e) * tap(guide, mask) * (kernel[i + 2] * kernel[j + 2]);
+
+          sum_r = sum_r + w * tr;
+          sum_g = sum_g + w * tg;
+          sum_b = sum_b + w * tb;
+          sum_v = sum_v + w * w * tap(in, variance);
+          sum_w = sum_w + w;
+        }
+      }
+
+      // The centre always has a weight unless it is outside the image.
+      float4 inv_w = float4(1.0f) / max(sum_w, float4(1e-20f));
+      (sum_r * inv_w).store(out.at(red, x, y));
+      (sum_g * inv_w).store(out.at(green, x, y));
+      (sum_b * inv_w).store(out.at(blue, x, y));
+      (sum_v * inv_w * inv_w).store(out.at(variance, x, y));
+    }
+  }
+}
+
+} // namespace denoise_ns
+
+using namespace denoise_ns;
+
+void denoise(Framebuffer& framebuffer, int threads)
+{
+  const int W = framebuffer.xres;
+  const int H = framebuffer.yres;
+
+  Planes guide(W, H, guide_planes);
+  Planes colour(W, H, colour_planes);
+  for (int y = 0; y < H; y++) {
+    for (int x = 0; x < W; x++) {
+      const Pixel& pixel = framebuffer.pixels[x + y * W];
+      AuxPixel aux = framebuffer.aux_mean(x + y * W);
+      float pixel_variance = 0;
+      for (int k = 0; k < 3; k++) {
+        float mean = pixel.value[k] / pixel.weight;
+        *colour.at(k, x, y) = mean;
+        // Variance of the mean, summed like luminance.
+        pixel_variance +=
+            (k == 1 ? 0.7152f : k == 0 ? 0.2126f : 0.0722f) *
+            std::max(0.0f, pixel.squares[k] / pixel.weight - mean * mean) /
+            std::max(pixel.samples, 1.0f);
+        *guide.at(albedo_r + k, x, y) = aux.albedo[k];
+        *guide.at(normal_x + k, x, y) = aux.normal[k];
+      }
+      *colour.at(variance, x, y) = pixel_variance;
+      *guide.at(depth, x, y) = aux.depth > 0 ? aux.depth : background_depth;
+      *guide.at(mask, x, y) = 1;
+    }
+  }
+
+  Planes temp(W, H, colour_planes);
+  threads = std::max(1, std::min(threads, H));
+  for (int it = 0; it < iterations; it++) {
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+      workers.emplace_back(filter_rows, std::cref(guide), std::cref(colour),
+                           std::ref(temp), W, H * i / threads,
+                           H * (i + 1) / threads, 1 << it);
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    std::swap(colour, temp);
+  }
+
+  for (int y = 0; y < H; y++) {
+    for (int x = 0; x < W; x++) {
+      Pixel& pixel = framebuffer.pixels[x + y * W];
+      for (int k = 0; k < 3; k++) {
+        pixel.value[k] = *colour.at(k, x, y) * pixel.weight;
+      }
+    }
+  }
+}
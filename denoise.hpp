@@ -0,0 +1,9 @@
+#pragma once
+
+class Framebuffer;
+
+/// Remove noise from the image with an edge-avoiding à-trous wavelet filter.
+/// The framebuffer's auxiliary buffers and per pixel variance decide how far
+/// the filter reaches: it blurs along surfaces but not across edges in
+/// geometry, albedo or brightness. Runs on `threads` threads.
+void denoise(Framebuffer& framebuffer, int threads);
@@ -0,0 +1,73 @@
+#include "filter.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace filter_ns {
+
+static float box(float x, float radius) { return 1; }
+
+/// Gaussian with a standard deviation of half a pixel, shifted down so that
+/// it reaches zero at the radius.
+static float gaussian(float x, float radius)
+{
+  const float sigma = 0.5f;
+  auto g = [=](float t) { return expf(-t * t / (2 * sigma * sigma)); };
+  return std::max(0.0f, g(x) - g(radius));
+}
+
+/// Mitchell-Netravali with B = C = 1/3, stretched from [0, 2) to the radius.
+static float mitchell(float x, float radius)
+{
+  const float B = 1.0f / 3, C = 1.0f / 3;
+  x = 2 * x / radius;
+  if (x < 1) {
+    return ((12 - 9 * B - 6 * C) * x * x * x + (-18 + 12 * B + 6 * C) * x * x +
+            (6 - 2 * B)) /
+           6;
+  }
+  return ((-B - 6 * C) * x * x * x + (6 * B + 30 * C) * x * x +
+          (-12 * B - 48 * C) * x + (8 * B + 24 * C)) /
+         6;
+}
+
+/// Four term Blackman-Harris window over [-radius, radius].
+static float blackman_harris(float x, float radius)
+{
+  const float a0 = 0.35875f, a1 = 0.48829f, a2 = 0.14128f, a3 = 0.01168f;
+  float t = float(M_PI) * (x / radius + 1);
+  return a0 - a1 * cosf(t) + a2 * cosf(2 * t) - a3 * cosf(3 * t);
+}
+
+} // namespace filter_ns
+
+using namespace filter_ns;
+
+Filter::Filter(float radius, float (*profile)(float x, float radius))
+    : radius(radius), scale(table_size / radius)
+{
+  // Sample the middle of each table entry.
+  for (int i = 0; i < table_size; i++) {
+    table[i] = profile((i + 0.5f) / scale, radius);
+  }
+}
+
+int Filter::margin() const { return int(ceilf(radius - 0.5f)); }
+
+std::shared_ptr<Filter> create_filter(const std::string& name, float radius)
+{
+  auto make = [&](float default_radius, float (*profile)(float, float)) {
+    return std::make_shared<Filter>(radius > 0 ? radius : default_radius,
+                                    profile);
+  };
+  if (name == "box")
+    return make(0.5f, box);
+  else if (name == "gaussian")
+    return make(1.5f, gaussian);
+  else if (name == "mitchell")
+    return make(2.0f, mitchell);
+  else if (name == "blackman-harris")
+    return make(2.0f, blackman_harris);
+  else
+    throw std::runtime_error("unknown filter '" + name + "'");
+}
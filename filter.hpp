@@ -0,0 +1,40 @@
+#pragma once
+#include <memory>
+#include <string>
+
+/// Separable pixel reconstruction filter. The 1D profile is tabulated once,
+/// so weighing a sample is two table lookups.
+class Filter {
+public:
+  /// Samples contribute to pixels whose centre is closer than this on both
+  /// axes.
+  float radius;
+
+  /// Tabulate `profile`, which is evaluated on [0, radius).
+  Filter(float radius, float (*profile)(float x, float radius));
+
+  /// Weight of a sample at offset (dx, dy) from a pixel centre, for offsets
+  /// within the radius.
+  float weight(float dx, float dy) const
+  {
+    return table[index(dx)] * table[index(dy)];
+  }
+
+  /// Pixels a sample may reach beyond the one it was taken in.
+  int margin() const;
+
+private:
+  static constexpr int table_size = 64;
+  float table[table_size];
+  float scale;
+
+  int index(float d) const
+  {
+    int i = int((d < 0 ? -d : d) * scale);
+    return i < table_size ? i : table_size - 1;
+  }
+};
+
+/// Create a filter by name: box, gaussian, mitchell or blackman-harris.
+/// A radius of 0 picks the filter's usual one.
+std::shared_ptr<Filter> create_filter(const std::string& name, float radius);
@@ -1,46 +1,446 @@
 #include "framebuffer.hpp"
 #include "pupumath.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <strings.h>
+#include <vector>
+#include <zlib.h>
 using namespace pupumath;
 
-inline Pixel::Pixel() : value(vec3(0.0f)), weight(0.0001f) {}
+static vec3 square(const vec3& v)
+{
+  return vec3{v.x * v.x, v.y * v.y, v.z * v.z};
+}
+
+inline Pixel::Pixel()
+    : value(vec3(0.0f)), weight(0.0001f), squares(vec3(0.0f)), samples(0)
+{
+}
 
 inline vec3 Pixel::normalized() const { return value / weight; }
 
+float Pixel::relative_error() const
+{
+  float error = 0;
+  for (int k = 0; k < 3; k++) {
+    float mean = value[k] / weight;
+    float variance = std::max(0.0f, squares[k] / weight - mean * mean);
+    error = std::max(error, sqrtf(variance / std::max(samples, 1.0f)) /
+                                std::max(mean, 0.01f));
+  }
+  return error;
+}
+
+AuxPixel::AuxPixel() : albedo(vec3(0.0f)), normal(vec3(0.0f)), depth(0) {}
+
+static void add(AuxPixel& dst, const AuxPixel& src)
+{
+  dst.albedo = dst.albedo + src.albedo;
+  dst.normal = dst.normal + src.normal;
+  dst.depth += src.depth;
+}
+
 Framebuffer::Framebuffer(int xres, int yres)
-    : xres(xres), yres(yres), pixels(new Pixel[xres * yres])
+    : xres(xres), yres(yres), pixels(new Pixel[xres * yres]),
+      aux(new AuxPixel[xres * yres])
 {
 }
 
+AuxPixel Framebuffer::aux_mean(int i) const
+{
+  float n = std::max(pixels[i].samples, 1.0f);
+  AuxPixel a = aux[i];
+  a.albedo = a.albedo / n;
+  a.normal = a.normal / n;
+  a.depth /= n;
+  return a;
+}
+
+/// Add to a float shared with other threads. There is no atomic float
+/// addition, so retry the compare-and-swap until no other thread came in
+/// between. Without contention this gives exactly the plain sum.
+static void atomic_add(float& target, float v)
+{
+  float expected;
+  __atomic_load(&target, &expected, __ATOMIC_RELAXED);
+  float desired = expected + v;
+  while (!__atomic_compare_exchange(&target, &expected, &desired, true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    desired = expected + v;
+  }
+}
+
+static void atomic_add(Pixel& dst, const vec3& value, float weight,
+                       const vec3& squares, float samples)
+{
+  for (int k = 0; k < 3; k++) atomic_add(dst.value[k], value[k]);
+  atomic_add(dst.weight, weight);
+  for (int k = 0; k < 3; k++) atomic_add(dst.squares[k], squares[k]);
+  atomic_add(dst.samples, samples);
+}
+
 void Framebuffer::add_sample(float x, float y, const vec3 &v)
 {
-  pixels[int(x) + int(y) * xres].value =
-      pixels[int(x) + int(y) * xres].value + v;
-  pixels[int(x) + int(y) * xres].weight += 1;
+  atomic_add(pixels[int(x) + int(y) * xres], v, 1, square(v), 1);
+}
+
+void Framebuffer::merge(const TileBuffer &tile)
+{
+  int xbegin = std::max(0, -tile.x0);
+  int ybegin = std::max(0, -tile.y0);
+  int xend = std::min(tile.xres, xres - tile.x0);
+  int yend = std::min(tile.yres, yres - tile.y0);
+  for (int y = ybegin; y < yend; y++) {
+    for (int x = xbegin; x < xend; x++) {
+      const Pixel &src = tile.pixels[x + y * tile.xres];
+      Pixel &dst = pixels[(tile.x0 + x) + (tile.y0 + y) * xres];
+      atomic_add(dst, src.value, src.weight, src.squares, src.samples);
+    }
+  }
+  // Only the tile itself has auxiliary data, and tiles don't overlap.
+  for (int y = tile.margin; y < tile.yres - tile.margin; y++) {
+    for (int x = tile.margin; x < tile.xres - tile.margin; x++) {
+      add(aux[(tile.x0 + x) + (tile.y0 + y) * xres],
+          tile.aux[x + y * tile.xres]);
+    }
+  }
+}
+
+TileBuffer::TileBuffer(int max_xres, int max_yres, int margin)
+    : x0(0), y0(0), xres(0), yres(0), margin(margin),
+      pixels(new Pixel[(max_xres + 2 * margin) * (max_yres + 2 * margin)]),
+      aux(new AuxPixel[(max_xres + 2 * margin) * (max_yres + 2 * margin)])
+{
+}
+
+void TileBuffer::reset(int x0, int y0, int xres, int yres)
+{
+  this->x0 = x0 - margin;
+  this->y0 = y0 - margin;
+  this->xres = xres + 2 * margin;
+  this->yres = yres + 2 * margin;
+  for (int i = 0; i < this->xres * this->yres; i++) {
+    pixels[i].value = vec3(0.0f);
+    pixels[i].weight = 0.0f;
+    pixels[i].squares = vec3(0.0f);
+    pixels[i].samples = 0.0f;
+    aux[i] = AuxPixel();
+  }
+}
+
+void TileBuffer::add_aux(int x, int y, const AuxPixel &a)
+{
+  add(aux[(x - x0) + (y - y0) * xres], a);
+}
+
+void TileBuffer::add_sample(float x, float y, const vec3 &v)
+{
+  Pixel &p = pixels[(int(x) - x0) + (int(y) - y0) * xres];
+  p.value = p.value + v;
+  p.weight += 1;
+  p.squares = p.squares + square(v);
+  p.samples += 1;
+}
+
+void TileBuffer::splat(int x, int y, const vec2 &offset, const vec3 &v,
+                       const Filter &filter)
+{
+  // Pixels with centres in (offset - radius, offset + radius], so that with
+  // the box filter every sample lands in exactly one pixel. Offsets are kept
+  // relative to the pixel, which keeps them exact far from the origin.
+  const float r = filter.radius;
+  int dx0 = int(floorf(offset.x - 0.5f - r)) + 1;
+  int dx1 = int(floorf(offset.x - 0.5f + r));
+  int dy0 = int(floorf(offset.y - 0.5f - r)) + 1;
+  int dy1 = int(floorf(offset.y - 0.5f + r));
+  // Offsets outside [0, 1) would reach past the margin and out of the buffer.
+  dx0 = std::max(dx0, -margin);
+  dx1 = std::min(dx1, margin);
+  dy0 = std::max(dy0, -margin);
+  dy1 = std::min(dy1, margin);
+  vec3 v2 = square(v);
+  for (int dy = dy0; dy <= dy1; dy++) {
+    for (int dx = dx0; dx <= dx1; dx++) {
+      float w = filter.weight(dx + 0.5f - offset.x, dy + 0.5f - offset.y);
+      Pixel &p = pixels[(x + dx - x0) + (y + dy - y0) * xres];
+      p.value = p.value + v * w;
+      p.weight += w;
+      p.squares = p.squares + v2 * w;
+    }
+  }
+  pixels[(x - x0) + (y - y0) * xres].samples += 1;
+}
+
+namespace framebuffer_ns {
+
+/// Output file that throws on errors and closes itself.
+class OutFile {
+public:
+  OutFile(const std::string& filename)
+      : filename(filename), file(fopen(filename.c_str(), "wb"))
+  {
+    if (!file) {
+      throw std::runtime_error("cannot open '" + filename + "' for writing");
+    }
+  }
+  ~OutFile()
+  {
+    if (file) fclose(file);
+  }
+
+  void write(const void* p, size_t n)
+  {
+    if (n && fwrite(p, 1, n, file) != n) fail();
+  }
+  void write(const std::string& s) { write(s.data(), s.size()); }
+  long tell()
+  {
+    long pos = ftell(file);
+    if (pos < 0) fail();
+    return pos;
+  }
+  void seek(long pos)
+  {
+    if (fseek(file, pos, SEEK_SET) != 0) fail();
+  }
+  void close()
+  {
+    FILE* f = file;
+    file = nullptr;
+    if (fclose(f) != 0) fail();
+  }
+
+private:
+  std::string filename;
+  FILE* file;
+
+  void fail() { throw std::runtime_error("cannot write '" + filename + "'"); }
+};
+
+/// Little endian byte sequences, independent of the host.
+class Bytes : public std::vector<unsigned char> {
+public:
+  void u8(unsigned v) { push_back(v); }
+  void u32(uint32_t v)
+  {
+    for (int i = 0; i < 32; i += 8) push_back(v >> i);
+  }
+  void u64(uint64_t v)
+  {
+    for (int i = 0; i < 64; i += 8) push_back(v >> i);
+  }
+  void f32(float v)
+  {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    u32(bits);
+  }
+  void str(const char* s) { insert(end(), s, s + strlen(s) + 1); }
+};
+
+static float to_srgb(float ck)
+{
+  // ck = ck / (1+ck);
+  // from http://en.wikipedia.org/wiki/SRGB
+  if (ck <= 0.0031308) {
+    ck *= 12.92;
+  }
+  else {
+    float a = 0.055;
+    ck = (1 + a) * powf(ck, 1 / 2.4) - a; // is 2.4 right?
+  }
+  return std::min(1.0f, std::max(0.0f, ck));
 }
 
-void Framebuffer::save_ppm(const std::string& filename)
+// OpenEXR constants, see "Technical Introduction to OpenEXR" and the file
+// layout document.
+const unsigned char exr_magic[4] = {0x76, 0x2f, 0x31, 0x01};
+constexpr uint32_t exr_version = 2;
+constexpr uint32_t exr_float = 2;
+constexpr int exr_zip_lines = 16;
+
+static void exr_attribute(Bytes& out, const char* name, const char* type,
+                          const Bytes& value)
 {
-  auto buffer = std::make_unique<char[]>(xres * yres * 3);
+  out.str(name);
+  out.str(type);
+  out.u32(value.size());
+  out.insert(out.end(), value.begin(), value.end());
+}
 
-  for (int i = 0; i < xres * yres; i++) {
-    vec3 c = pixels[i].normalized();
-    for (int k = 0; k < 3; k++) {
-      float ck = c[k];
-      // ck = ck / (1+ck);
-      // from http://en.wikipedia.org/wiki/SRGB
-      if (ck <= 0.0031308) {
-        ck *= 12.92;
+/// Zip a block the way OpenEXR does: split even and odd bytes, store the
+/// differences of consecutive bytes, and deflate. Returns false if that
+/// doesn't make the block smaller, in which case it is stored as is.
+static bool exr_zip(const Bytes& raw, Bytes& packed)
+{
+  size_t n = raw.size();
+  std::vector<unsigned char> split(n);
+  size_t half = (n + 1) / 2;
+  for (size_t i = 0; i < n; i++) {
+    split[(i % 2) * half + i / 2] = raw[i];
+  }
+  for (size_t i = n - 1; i > 0; i--) {
+    split[i] = split[i] - split[i - 1] + 128;
+  }
+  uLongf size = compressBound(n);
+  packed.resize(size);
+  if (compress2(packed.data(), &size, split.data(), n, Z_DEFAULT_COMPRESSION) !=
+          Z_OK ||
+      size >= n) {
+    return false;
+  }
+  packed.resize(size);
+  return true;
+}
+
+} // namespace framebuffer_ns
+
+using namespace framebuffer_ns;
+
+void Framebuffer::save_ppm(const std::string& filename) const
+{
+  // Written a row at a time, so there is no second copy of the image.
+  OutFile out(filename);
+  out.write("P6\n" + std::to_string(xres) + " " + std::to_string(yres) +
+            "\n255\n");
+  std::vector<unsigned char> row(xres * 3);
+  for (int y = 0; y < yres; y++) {
+    for (int x = 0; x < xres; x++) {
+      vec3 c = pixels[x + y * xres].normalized();
+      for (int k = 0; k < 3; k++) {
+        row[x * 3 + k] = int(255 * to_srgb(c[k]));
       }
-      else {
-        float a = 0.055;
-        ck = (1 + a) * powf(ck, 1 / 2.4) - a; // is 2.4 right?
+    }
+    out.write(row.data(), row.size());
+  }
+  out.close();
+}
+
+void Framebuffer::save_pfm(const std::string& filename) const
+{
+  OutFile out(filename);
+  // A negative scale means little endian.
+  out.write("PF\n" + std::to_string(xres) + " " + std::to_string(yres) +
+            "\n-1.0\n");
+  Bytes row;
+  // Rows go from the bottom up.
+  for (int y = yres - 1; y >= 0; y--) {
+    row.clear();
+    for (int x = 0; x < xres; x++) {
+      vec3 c = pixels[x + y * xres].normalized();
+      for (int k = 0; k < 3; k++) row.f32(c[k]);
+    }
+    out.write(row.data(), row.size());
+  }
+  out.close();
+}
+
+void Framebuffer::save_exr(const std::string& filename,
+                           ExrCompression compression) const
+{
+  const int lines = compression == ExrCompression::zip ? exr_zip_lines : 1;
+  const int blocks = (yres + lines - 1) / lines;
+
+  Bytes header;
+  header.insert(header.end(), exr_magic, exr_magic + 4);
+  header.u32(exr_version);
+
+  // Channels are stored in alphabetical order.
+  Bytes channels;
+  for (const char* name : {"B", "G", "R"}) {
+    channels.str(name);
+    channels.u32(exr_float);
+    channels.u32(0); // pLinear and reserved
+    channels.u32(1); // x sampling
+    channels.u32(1); // y sampling
+  }
+  channels.u8(0);
+  exr_attribute(header, "channels", "chlist", channels);
+
+  Bytes value;
+  value.u8(compression == ExrCompression::zip ? 3 : 0);
+  exr_attribute(header, "compression", "compression", value);
+  value.clear();
+  value.u32(0);
+  value.u32(0);
+  value.u32(xres - 1);
+  value.u32(yres - 1);
+  exr_attribute(header, "dataWindow", "box2i", value);
+  exr_attribute(header, "displayWindow", "box2i", value);
+  value.clear();
+  value.u8(0); // increasing y
+  exr_attribute(header, "lineOrder", "lineOrder", value);
+  value.clear();
+  value.f32(1);
+  exr_attribute(header, "pixelAspectRatio", "float", value);
+  exr_attribute(header, "screenWindowWidth", "float", value);
+  value.clear();
+  value.f32(0);
+  value.f32(0);
+  exr_attribute(header, "screenWindowCenter", "v2f", value);
+  header.u8(0);
+
+  // Compressed block sizes aren't known in advance, so the offset table is
+  // filled in at the end.
+  OutFile out(filename);
+  out.write(header.data(), header.size());
+  long table_pos = out.tell();
+  Bytes table;
+  table.resize(blocks * sizeof(uint64_t));
+  out.write(table.data(), table.size());
+  table.clear();
+
+  Bytes raw, packed, chunk;
+  for (int y0 = 0; y0 < yres; y0 += lines) {
+    table.u64(out.tell());
+    raw.clear();
+    for (int y = y0; y < std::min(yres, y0 + lines); y++) {
+      for (int k = 2; k >= 0; k--) {
+        for (int x = 0; x < xres; x++) {
+          raw.f32(pixels[x + y * xres].normalized()[k]);
+        }
       }
-      ck = std::min(1.0f, std::max(0.0f, ck));
-      buffer[i * 3 + k] = int(255 * ck);
     }
+    bool zipped = compression == ExrCompression::zip && exr_zip(raw, packed);
+    const Bytes& data = zipped ? packed : raw;
+    chunk.clear();
+    chunk.u32(y0);
+    chunk.u32(data.size());
+    out.write(chunk.data(), chunk.size());
+    out.write(data.data(), data.size());
+  }
+
+  out.seek(table_pos);
+  out.write(table.data(), table.size());
+  out.close();
+}
+
+void Framebuffer::save(const std::string& filename,
+                       ExrCompression exr_compression) const
+{
+  save_as(filename, filename, exr_compression);
+}
+
+void Framebuffer::save_as(const std::string& name, const std::string& filename,
+                          ExrCompression exr_compression) const
+{
+  auto has_extension = [&](const char* ext) {
+    size_t n = strlen(ext);
+    return name.size() >= n &&
+           strcasecmp(name.c_str() + name.size() - n, ext) == 0;
+  };
+  if (has_extension(".pfm")) {
+    save_pfm(filename);
+  }
+  else if (has_extension(".exr")) {
+    save_exr(filename, exr_compression);
+  }
+  else {
+    save_ppm(filename);
   }
-  FILE *fp = fopen(filename.c_str(), "wb");
-  fprintf(fp, "P6\n%d %d\n255\n", xres, yres);
-  fwrite(buffer.get(), xres * yres * 3, 1, fp);
-  fclose(fp);
 }
@@ -1,23 +1,100 @@
 #pragma once
 #include "pupumath_struct.hpp"
+#include "filter.hpp"
 #include <memory>
+#include <string>
 
 struct Pixel {
   pupumath::vec3 value;
   float weight;
+  /// Weighted sum of squared samples, for estimating the variance.
+  pupumath::vec3 squares;
+  /// Number of samples taken in this pixel. With a filter wider than the
+  /// pixel, `weight` also includes neighbouring pixels' samples.
+  float samples;
 
   Pixel();
 
   pupumath::vec3 normalized() const;
+  /// Standard error of the mean relative to the mean, for the worst channel.
+  /// Means below 0.01 count as 0.01 so that dark pixels can converge.
+  float relative_error() const;
 };
 
+/// What the camera rays of a pixel hit first, summed over the pixel's own
+/// samples. Guides the denoiser.
+struct AuxPixel {
+  pupumath::vec3 albedo;
+  pupumath::vec3 normal;
+  /// Distance to the hit, 0 for rays that escaped.
+  float depth;
+
+  AuxPixel();
+};
+
+/// Accumulation buffer for one tile of the image. Owned by a single render
+/// thread and merged into the framebuffer once the tile is finished, so that
+/// samples are added without any contention.
+///
+/// The buffer extends `margin` pixels past the tile on every side, for
+/// samples that also contribute to pixels of neighbouring tiles.
+class TileBuffer {
+public:
+  /// Region covered by the buffer, including the margin. It may extend
+  /// outside the image.
+  int x0, y0, xres, yres;
+  int margin;
+  std::unique_ptr<Pixel[]> pixels;
+  /// Same layout as `pixels`, but only the tile itself is used.
+  std::unique_ptr<AuxPixel[]> aux;
+
+  TileBuffer(int max_xres, int max_yres, int margin = 0);
+
+  /// Clear the buffer and place it at the given tile.
+  void reset(int x0, int y0, int xres, int yres);
+  /// Add a sample at image coordinates (x, y).
+  void add_sample(float x, float y, const pupumath::vec3 &v);
+  /// Add a sample taken at `offset` within pixel (x, y) to every pixel
+  /// within the filter's radius. The margin must be at least the filter's.
+  void splat(int x, int y, const pupumath::vec2 &offset,
+             const pupumath::vec3 &v, const Filter &filter);
+  /// Add first hit information for a sample taken in pixel (x, y).
+  void add_aux(int x, int y, const AuxPixel &a);
+};
+
+enum class ExrCompression { none, zip };
+
 class Framebuffer {
 public:
   int xres, yres;
   std::unique_ptr<Pixel[]> pixels;
+  std::unique_ptr<AuxPixel[]> aux;
 
   Framebuffer(int xres, int yres);
 
+  /// Averages of the auxiliary buffer at pixel index `i`.
+  AuxPixel aux_mean(int i) const;
+
+  /// Add a sample at image coordinates (x, y). Lock-free, so any number of
+  /// threads may add samples at the same time.
   void add_sample(float x, float y, const pupumath::vec3 &v);
-  void save_ppm(const std::string& filename);
+  /// Add the contents of a tile buffer, dropping what falls outside the
+  /// image. Lock-free, so tiles may be merged concurrently even when their
+  /// margins overlap.
+  void merge(const TileBuffer &tile);
+  /// Write the image in the format given by the file extension: linear RGB
+  /// floats for .pfm and .exr, and 8 bit sRGB otherwise.
+  void save(const std::string& filename,
+            ExrCompression exr_compression = ExrCompression::zip) const;
+  /// Like save(), but write to `filename` in the format for `name`.
+  void save_as(const std::string& name, const std::string& filename,
+               ExrCompression exr_compression = ExrCompression::zip) const;
+
+  /// 8 bit sRGB, clamped.
+  void save_ppm(const std::string& filename) const;
+  /// Linear RGB as 32 bit floats.
+  void save_pfm(const std::string& filename) const;
+  /// Linear RGB as 32 bit floats in a single part scanline OpenEXR file.
+  void save_exr(const std::string& filename,
+                ExrCompression compression = ExrCompression::zip) const;
 };
@@ -1,6 +1,7 @@
 #include "debug.hpp"
 #include "integrator.hpp"
 #include "material.hpp"
+#include "packet.hpp"
 #include "pupumath.hpp"
 #include "ray.hpp"
 #include "sampler.hpp"
@@ -60,13 +61,13 @@ public:
     return it != list.end();
   }
 
-  const GeometricObject* top()
+  const GeometricObject* top() const
   {
     if (list.size() == 0) return nullptr;
     return list.back();
   }
 
-  const GeometricObject* next_top()
+  const GeometricObject* next_top() const
   {
     if (list.size() < 2) return nullptr;
     return list[list.size() - 2];
@@ -93,38 +94,260 @@ public:
   size_t size() const { return list.size(); }
 };
 
-float radiance(const Scene& scene, Ray& ray, float wavelen, Sample& sample,
-               int nested, InteriorList& interior)
+/// Find the nearest object hit by the world space ray. Only objects whose
+/// bounds the ray passes through are transformed into object space.
+static bool intersect_scene(const Scene& scene, Ray& ray,
+                            const InteriorList& interior)
 {
-  if (nested > 100) return 0.0f;
-
-  DebugNester debugnester;
-  debug.ray(ray);
-
-  bool hit = false;
-  for (const auto& o : scene.objects) {
+  auto intersect_object = [&](int index) {
+    const GeometricObject& o = scene.objects[index];
     Ray oray = {inverse_transform_point(o.xform, ray.origin),
                 inverse_transform_vector(o.xform, ray.direction), ray.tmax,
                 ray.originator};
-    if (o.shape->intersect(oray, oray.originator == &o, interior.has(&o))) {
+    if (!o.shape->intersect(oray, oray.originator == &o, interior.has(&o))) {
+      return false;
+    }
+    ray.hit_object = &o;
+    ray.tmax = oray.tmax;
+    ray.position = transform_point(o.xform, oray.position);
+    ray.normal = normalize(transform_normal(o.xform, oray.normal));
+    return true;
+  };
+
+  bool hit = false;
+  for (int index : scene.unbounded) {
+    if (intersect_object(index)) hit = true;
+  }
+  if (scene.bvh.traverse(ray, intersect_object)) hit = true;
+  return hit;
+}
+
+/// intersect_scene() for up to four rays at once, which share the traversal
+/// of the hierarchy and the object space tests. Meant for coherent rays, such
+/// as the camera rays of a pixel. Returns the lanes that hit as bits.
+static int intersect_scene4(const Scene& scene, Ray* const rays[4],
+                            const InteriorList* const interiors[4], int count)
+{
+  RayPacket world;
+  for (int i = 0; i < 4; i++) {
+    // Spare lanes repeat the first ray, but take no part.
+    const Ray& ray = *rays[i < count ? i : 0];
+    world.origin.set_lane(i, ray.origin);
+    world.direction.set_lane(i, ray.direction);
+    world.tmax[i] = ray.tmax;
+  }
+  const mask4 active = mask4::from_bits((1 << count) - 1);
+
+  auto intersect_object = [&](int index, mask4 lanes) {
+    const GeometricObject& o = scene.objects[index];
+    RayPacket oray;
+    int originator = 0, inside = 0;
+    for (int i = 0; i < count; i++) {
+      oray.origin.set_lane(
+          i, inverse_transform_point(o.xform, world.origin.lane(i)));
+      oray.direction.set_lane(
+          i, inverse_transform_vector(o.xform, world.direction.lane(i)));
+      if (rays[i]->originator == &o) originator |= 1 << i;
+      if (interiors[i]->has(&o)) inside |= 1 << i;
+    }
+    for (int i = count; i < 4; i++) {
+      oray.origin.set_lane(i, oray.origin.lane(0));
+      oray.direction.set_lane(i, oray.direction.lane(0));
+    }
+    oray.tmax = world.tmax;
+
+    mask4 hit = o.shape->intersect4(oray, lanes, mask4::from_bits(originator),
+                                    mask4::from_bits(inside));
+    for (int i = 0; i < count; i++) {
+      if (!hit[i]) continue;
+      Ray& ray = *rays[i];
       ray.hit_object = &o;
-      hit = true;
-      ray.tmax = oray.tmax;
-      ray.position = transform_point(o.xform, oray.position);
-      ray.normal = normalize(transform_normal(o.xform, oray.normal));
+      ray.tmax = oray.tmax[i];
+      ray.position = transform_point(o.xform, oray.position.lane(i));
+      ray.normal = normalize(transform_normal(o.xform, oray.normal.lane(i)));
     }
+    world.tmax = select(hit, oray.tmax, world.tmax);
+    return hit;
+  };
+
+  mask4 hit(false);
+  for (int index : scene.unbounded) {
+    hit = hit | intersect_object(index, active);
   }
+  hit = hit | scene.bvh.traverse4(world, active, intersect_object);
+  return hit.bits();
+}
+
+/// Power heuristic weight for a sample taken with density `pdf` when another
+/// strategy would have produced it with density `other_pdf`.
+static float power_heuristic(float pdf, float other_pdf)
+{
+  float a = pdf * pdf;
+  float b = other_pdf * other_pdf;
+  return a / (a + b);
+}
+
+/// Light sampled at a path vertex. The shadow ray is traced separately, so
+/// that the wavefront integrator can trace all of them in one go.
+struct DirectSample {
+  /// False if the lights were not sampled at the vertex.
+  bool sampled = false;
+  /// False if the light sample contributes nothing and needs no shadow ray.
+  bool has_ray = false;
+  /// Shadow ray from the vertex to the point on the light.
+  vec3 origin;
+  vec3 direction;
+  float distance;
+  const GeometricObject* originator;
+  /// Contribution if nothing blocks the shadow ray.
+  SampledSpectrum Ld;
+  /// Absorption along the segment that arrived at the vertex.
+  SampledSpectrum absorbtion;
+};
+
+/// Estimate the direct light reflected towards `wo_t` by sampling a point on
+/// an emissive object. The result is weighted against finding the same light
+/// by sampling the BSDF, and it holds if the shadow ray in `direct` gets
+/// through.
+static void sample_direct(const Scene& scene, const Ray& ray,
+                          const SampledSpectrum& wavelens, Sample& sample,
+                          const mat3& to_tangent, const vec3& wo_t,
+                          DirectSample& direct)
+{
+  direct.sampled = true;
+  direct.has_ray = false;
+  direct.Ld = SampledSpectrum(0.0f);
+
+  vec3 u = sample.light();
+  LightSample ls = scene.sample_light(u[0], u[1], u[2]);
+  if (!(ls.pdf > 0)) return;
+
+  vec3 d = ls.position - ray.position;
+  float dist2 = dot(d, d);
+  if (!(dist2 > 0)) return;
+  float dist = std::sqrt(dist2);
+  vec3 wi = d / dist;
+  // Emitters radiate from their front side only: a path that hits the back
+  // of one passes through it, so it can't find the light there either.
+  float cos_l = -dot(wi, ls.normal);
+  if (!(cos_l > 0)) return;
+  vec3 wi_t = mul(to_tangent, wi);
+
+  const Material& mat = *ray.hit_object->mat;
+  SampledSpectrum f = mat.f(wo_t, wi_t, wavelens);
+  if (!(f.max_value() > 0)) return;
+
+  SampledSpectrum Le = ls.object->mat->emittance.sample(wavelens);
+  // Convert the area density into a solid angle density at the hit.
+  float light_pdf = ls.pdf * dist2 / cos_l;
+  float weight = abs_cos_theta(wi_t) / light_pdf *
+                 power_heuristic(light_pdf, mat.pdf(wo_t, wi_t));
+  SampledSpectrum Ld = f * Le * weight;
+  if (!(Ld.max_value() > 0)) return;
+
+  direct.has_ray = true;
+  direct.origin = ray.position;
+  direct.direction = wi;
+  direct.distance = dist;
+  direct.originator = ray.hit_object;
+  direct.Ld = Ld;
+}
+
+/// The shadow ray of a light sample that has one. Anything it hits blocks
+/// the light.
+static Ray shadow_ray(const DirectSample& direct)
+{
+  return {direct.origin, direct.direction, direct.distance * (1 - 1e-4f),
+          direct.originator};
+}
+
+/// The light that arrives from a light sample, including absorption by the
+/// object the path is in, given whether its shadow ray was blocked.
+static SampledSpectrum direct_light(const DirectSample& direct, bool occluded,
+                                    const InteriorList& interior,
+                                    const SampledSpectrum& wavelens)
+{
+  if (!direct.sampled) return SampledSpectrum(0.0f);
+  SampledSpectrum Ld = direct.Ld;
+  if (direct.has_ray) {
+    if (occluded) {
+      Ld = SampledSpectrum(0.0f);
+    }
+    else if (interior.size() > 0) {
+      Ld *= interior.top()->mat->absorb(direct.distance, wavelens);
+    }
+  }
+  return direct.absorbtion * Ld;
+}
+
+/// Trace the shadow ray of a light sample and return the light that arrives.
+static SampledSpectrum trace_direct(const Scene& scene,
+                                    const DirectSample& direct,
+                                    const InteriorList& interior,
+                                    const SampledSpectrum& wavelens)
+{
+  bool occluded = false;
+  if (direct.sampled && direct.has_ray) {
+    Ray shadow = shadow_ray(direct);
+    occluded = intersect_scene(scene, shadow, interior);
+  }
+  return direct_light(direct, occluded, interior, wavelens);
+}
+
+/// Find the surface hit by `ray`. Returns false if the ray escaped.
+static bool find_hit(const Scene& scene, Ray& ray,
+                     const InteriorList& interior)
+{
+  debug.ray(ray);
+
+  bool hit = intersect_scene(scene, ray, interior);
   if (!hit) {
     debug.miss();
-    return scene.skybox->sample(ray.direction, wavelen);
+    return false;
   }
 
   debug.hit(ray);
+  return true;
+}
 
-  float absorbtion = 1.0;
+/// find_hit() for up to four coherent rays. Returns the lanes that hit as
+/// bits.
+static int find_hits4(const Scene& scene, Ray* const rays[4],
+                      const InteriorList* const interiors[4], int count)
+{
+  for (int i = 0; i < count; i++) {
+    debug.ray(*rays[i]);
+  }
+
+  int hits = intersect_scene4(scene, rays, interiors, count);
+  for (int i = 0; i < count; i++) {
+    if (hits & (1 << i)) {
+      debug.hit(*rays[i]);
+    }
+    else {
+      debug.miss();
+    }
+  }
+  return hits;
+}
+
+/// Shade the hit found by find_hit(): choose the continuation direction,
+/// update the interior list and sample the lights. `direct` receives the
+/// light sample, whose shadow ray still needs to be traced. `bsdf_pdf` is
+/// the solid angle density with which the ray's direction was sampled, or
+/// zero if the lights were not sampled at its origin; on return it holds the
+/// same for `wi_w`. `hero_only` is set once dispersion has left only the
+/// hero wavelength.
+static void shade_hit(const Scene& scene, const Ray& ray,
+                      const SampledSpectrum& wavelens, Sample& sample,
+                      InteriorList& interior, vec3& wi_w,
+                      SampledSpectrum& factor, SampledSpectrum& Le,
+                      DirectSample& direct, float& bsdf_pdf, bool& hero_only)
+{
+  SampledSpectrum absorbtion(1.0f);
   if (interior.size() > 0) {
     debug.log("absorb");
-    absorbtion = interior.top()->mat->absorb(ray.tmax, wavelen);
+    absorbtion = interior.top()->mat->absorb(ray.tmax, wavelens);
   }
 
   if (dot(ray.direction, ray.normal) < 0) {
@@ -141,46 +364,56 @@ float radiance(const Scene& scene, Ray& ray, float wavelen, Sample& sample,
     debug.log("☷ false intersection");
   }
 
-  vec3 wi_w;
-  float factor;
-  float Le = 0.0f;
+  Le = SampledSpectrum(0.0f);
+  direct.sampled = false;
 
   if (true_intersection) {
-    float outer_refractive_index = 1.0;
+    const Material& mat = *ray.hit_object->mat;
+    SampledSpectrum outer_refractive_index(1.0f);
     if (interior.size() > 1) {
       outer_refractive_index =
-          interior.next_top()->mat->refractive_index.sample(wavelen);
+          interior.next_top()->mat->refractive_index.sample(wavelens);
     }
 
     mat3 from_tangent = basis_from_normal(ray.normal);
     mat3 to_tangent = inverse(from_tangent);
 
     vec3 wo_t = mul(to_tangent, -ray.direction);
-    // vec3 wi_t = vec3(0, 0, 1);
-    // vec3 wi_t = vec3(-wo_t.x, -wo_t.y, wo_t.z);
-    // vec3 sample = sampler.shading[sample_index];
     vec3 wi_t;
     float pdf;
-    // float fr = brdf_lambertian(wo_t, wi_t, pdf, sample[0], sample[1]);
-    // float fr = brdf_lambertian(wo_t, wi_t, pdf, frand(), frand());
     vec2 u12 = sample.shading();
-    float fr = ray.hit_object->mat->fr(
-        // wo_t, wi_t, wavelen, outer_refractive_index, pdf, frand(), frand());
-        // wo_t, wi_t, wavelen, outer_refractive_index, pdf,
-        // sampler.shading[sample_index].x, sampler.shading[sample_index].y);
-        wo_t, wi_t, wavelen, outer_refractive_index, pdf, u12[0], u12[1]);
+    SampledSpectrum fr = mat.fr(wo_t, wi_t, wavelens, outer_refractive_index,
+                                pdf, u12[0], u12[1]);
     wi_w = mul(from_tangent, wi_t);
 
     debug.shading(wo_t, wi_t, true);
     debug.shading(-ray.direction, wi_w, false);
 
-    factor = fr * abs_cos_theta(wi_t) / pdf;
+    factor = fr * (abs_cos_theta(wi_t) / pdf);
+
+    if (!hero_only && mat.disperses(wavelens, outer_refractive_index)) {
+      // The other wavelengths would have scattered elsewhere. Only the hero
+      // continues, carrying the weight of the whole set.
+      debug.log("⧗ dispersion");
+      hero_only = true;
+      factor[0] *= SampledSpectrum::lanes;
+      for (int i = 1; i < SampledSpectrum::lanes; i++) factor[i] = 0.0f;
+    }
 
-    Le = ray.hit_object->mat->emittance.sample(wavelen);
+    Le = mat.emittance.sample(wavelens);
+    if (Le.max_value() > 0 && bsdf_pdf > 0) {
+      // The lights were sampled at the previous vertex as well. A true
+      // intersection is on the front side, the only side sample_direct()
+      // takes, so the two weights add up to one.
+      float light_pdf = scene.light_pdf(ray.hit_object, ray.normal) *
+                        ray.tmax * ray.tmax /
+                        -dot(ray.direction, ray.normal);
+      Le *= power_heuristic(bsdf_pdf, light_pdf);
+    }
   }
   else {
     wi_w = ray.direction;
-    factor = 1.0;
+    factor = SampledSpectrum(1.0f);
   }
 
   if (dot(wi_w, ray.normal) > 0) {
@@ -188,19 +421,305 @@ float radiance(const Scene& scene, Ray& ray, float wavelen, Sample& sample,
     interior.remove(ray.hit_object);
   }
 
-  if(factor*absorbtion > .01) {
-  Ray next_ray = {ray.position, wi_w, 1000.0, ray.hit_object};
-  float L = radiance(scene, next_ray, wavelen, sample, nested + 1, interior);
+  // Sample the lights after the interior list has been updated, so that the
+  // shadow ray starts on the same side as the continuation ray. Only matte
+  // like materials are non-delta and they reflect to that side only.
+  // Shadow rays stop at surfaces that paths pass through, so emitters
+  // behind a false intersection can only be found by the BSDF sample.
+  bsdf_pdf = 0.0f;
+  if (true_intersection && !ray.hit_object->mat->is_delta() &&
+      !scene.lights.empty()) {
+    mat3 to_tangent = inverse(basis_from_normal(ray.normal));
+    vec3 wo_t = mul(to_tangent, -ray.direction);
+    sample_direct(scene, ray, wavelens, sample, to_tangent, wo_t, direct);
+    direct.absorbtion = absorbtion;
+    bsdf_pdf = ray.hit_object->mat->pdf(wo_t, mul(to_tangent, wi_w));
+  }
+
+  factor *= absorbtion;
+}
 
-  return factor * absorbtion * L + Le;
+/// Trace one segment of a path: find_hit(), shade_hit() and trace_direct()
+/// in a row. Returns false if the ray escaped, in which case `Le` holds the
+/// sky radiance. `Ld` receives the light sampled directly at the hit.
+static bool trace_segment(const Scene& scene, Ray& ray,
+                          const SampledSpectrum& wavelens, Sample& sample,
+                          InteriorList& interior, vec3& wi_w,
+                          SampledSpectrum& factor, SampledSpectrum& Le,
+                          SampledSpectrum& Ld, float& bsdf_pdf,
+                          bool& hero_only)
+{
+  if (!find_hit(scene, ray, interior)) {
+    Le = scene.skybox->sample(ray.direction, wavelens);
+    return false;
   }
-  else {
-    return Le;
+
+  DirectSample direct;
+  shade_hit(scene, ray, wavelens, sample, interior, wi_w, factor, Le, direct,
+            bsdf_pdf, hero_only);
+  Ld = trace_direct(scene, direct, interior, wavelens);
+  return true;
+}
+
+SampledSpectrum radiance(const Scene& scene, Ray& ray,
+                         const SampledSpectrum& wavelens, Sample& sample,
+                         const IntegratorSettings& settings,
+                         SampledSpectrum* albedo)
+{
+  // Hard limit for paths trapped by total internal reflection.
+  constexpr int max_depth = 100;
+
+  // Reuse the list's storage from path to path.
+  static thread_local InteriorList interior;
+  interior.clear();
+  SampledSpectrum L(0.0f);
+  SampledSpectrum throughput(1.0f);
+  bool hero_only = false;
+  // Density of the current direction for weighting emitters it finds.
+  float bsdf_pdf = 0.0f;
+
+  Ray r = ray;
+  for (int depth = 0; depth <= max_depth; depth++) {
+    debug.nest_level = depth + 1;
+
+    vec3 wi_w;
+    SampledSpectrum factor(0.0f);
+    SampledSpectrum Le;
+    SampledSpectrum Ld(0.0f);
+    bool hit = trace_segment(scene, r, wavelens, sample, interior, wi_w,
+                             factor, Le, Ld, bsdf_pdf, hero_only);
+    // Hand the primary hit back to the caller.
+    if (depth == 0) {
+      ray = r;
+      if (albedo) *albedo = hit ? factor : SampledSpectrum(0.0f);
+    }
+    L += throughput * (Le + Ld);
+    if (!hit) break;
+
+    throughput *= factor;
+    if (!(throughput.max_value() > 0.0f)) break;
+
+    // Russian roulette: continue with a probability proportional to the
+    // largest throughput and compensate the survivors, which keeps the
+    // estimate unbiased.
+    if (depth + 1 >= settings.rr_min_depth) {
+      float survival =
+          std::min(throughput.max_value(), settings.rr_max_survival);
+      if (sample.rng.uniform() >= survival) break;
+      throughput /= survival;
+    }
+
+    r.origin = r.position;
+    r.direction = wi_w;
+    r.tmax = 1000.0;
+    r.originator = r.hit_object;
   }
+  debug.nest_level = 0;
+
+  return L;
 }
 
-float radiance(const Scene& scene, Ray& ray, float wavelen, Sample& sample)
+/// Path state for radiance_wavefront(), one array per field, indexed like
+/// the paths. Kept from call to call to reuse the storage.
+struct WavefrontState {
+  std::vector<Ray> ray;
+  std::vector<SampledSpectrum> throughput;
+  std::vector<SampledSpectrum> factor;
+  std::vector<SampledSpectrum> Le;
+  std::vector<SampledSpectrum> Ld;
+  std::vector<vec3> wi;
+  std::vector<float> bsdf_pdf;
+  std::vector<char> hero_only;
+  std::vector<char> hit;
+  std::vector<InteriorList> interior;
+  std::vector<DirectSample> direct;
+  /// Segments traced so far, for the statistics.
+  std::vector<int> segments;
+
+  /// Indices of the paths still being traced, and of those that continue
+  /// after the current bounce.
+  std::vector<int> live, next;
+  /// Hits of the current bounce by material, in order of first appearance.
+  std::vector<std::pair<const Material*, std::vector<int>>> by_material;
+
+  void resize(size_t n)
+  {
+    ray.resize(n);
+    throughput.resize(n);
+    factor.resize(n);
+    Le.resize(n);
+    Ld.resize(n);
+    wi.resize(n);
+    bsdf_pdf.resize(n);
+    hero_only.resize(n);
+    hit.resize(n);
+    interior.resize(n);
+    direct.resize(n);
+    segments.resize(n);
+  }
+
+  std::vector<int>& material_queue(const Material* mat)
+  {
+    for (auto& queue : by_material) {
+      if (queue.first == mat) return queue.second;
+    }
+    by_material.emplace_back(mat, std::vector<int>());
+    return by_material.back().second;
+  }
+};
+
+void radiance_wavefront(const Scene& scene, std::vector<CameraPath>& paths,
+                        const IntegratorSettings& settings)
 {
-  InteriorList interior;
-  return radiance(scene, ray, wavelen, sample, 0, interior);
+  // Same limit as in radiance().
+  constexpr int max_depth = 100;
+
+  static thread_local WavefrontState st;
+  st.resize(paths.size());
+
+  // Generate.
+  st.live.clear();
+  for (size_t i = 0; i < paths.size(); i++) {
+    debug.begin_path();
+    st.ray[i] = paths[i].ray;
+    st.throughput[i] = SampledSpectrum(1.0f);
+    st.bsdf_pdf[i] = 0.0f;
+    st.hero_only[i] = false;
+    st.interior[i].clear();
+    st.segments[i] = 0;
+    paths[i].L = SampledSpectrum(0.0f);
+    st.live.push_back(int(i));
+  }
+
+  for (int depth = 0; !st.live.empty(); depth++) {
+    debug.nest_level = depth + 1;
+
+    // Intersect. The camera rays come in runs of samples of the same pixel,
+    // so they are traced four at a time, except for a path being debugged,
+    // which logs its rays on its own.
+    int group[4];
+    int grouped = 0;
+    auto intersect_group = [&]() {
+      Ray* rays[4];
+      const InteriorList* interiors[4];
+      for (int j = 0; j < grouped; j++) {
+        rays[j] = &st.ray[group[j]];
+        interiors[j] = &st.interior[group[j]];
+      }
+      int hits = find_hits4(scene, rays, interiors, grouped);
+      for (int j = 0; j < grouped; j++) {
+        st.hit[group[j]] = (hits >> j) & 1;
+      }
+      grouped = 0;
+    };
+    for (int i : st.live) {
+      st.segments[i]++;
+      if (depth == 0 && !paths[i].debug) {
+        group[grouped++] = i;
+        if (grouped == 4) intersect_group();
+      }
+      else {
+        debug.enabled = paths[i].debug;
+        st.hit[i] = find_hit(scene, st.ray[i], st.interior[i]);
+        debug.enabled = false;
+      }
+    }
+    if (grouped > 0) intersect_group();
+
+    // Look up the sky for the rays that escaped, and queue the hits for
+    // shading.
+    for (auto& queue : st.by_material) queue.second.clear();
+    for (int i : st.live) {
+      if (st.hit[i]) {
+        st.material_queue(st.ray[i].hit_object->mat.get()).push_back(i);
+      }
+      else {
+        st.Le[i] = scene.skybox->sample(st.ray[i].direction,
+                                        paths[i].wavelens);
+        st.factor[i] = SampledSpectrum(0.0f);
+        st.Ld[i] = SampledSpectrum(0.0f);
+      }
+    }
+
+    // Shade one material at a time.
+    for (const auto& queue : st.by_material) {
+      for (int i : queue.second) {
+        bool hero_only = st.hero_only[i];
+        debug.enabled = paths[i].debug;
+        shade_hit(scene, st.ray[i], paths[i].wavelens, paths[i].sample,
+                  st.interior[i], st.wi[i], st.factor[i], st.Le[i],
+                  st.direct[i], st.bsdf_pdf[i], hero_only);
+        st.hero_only[i] = hero_only;
+      }
+    }
+    debug.enabled = false;
+
+    // Trace the shadow rays. Those from the first hits of neighbouring
+    // camera rays head the same way, so they too are traced four at a time.
+    auto trace_group = [&]() {
+      Ray shadows[4];
+      Ray* rays[4];
+      const InteriorList* interiors[4];
+      for (int j = 0; j < grouped; j++) {
+        shadows[j] = shadow_ray(st.direct[group[j]]);
+        rays[j] = &shadows[j];
+        interiors[j] = &st.interior[group[j]];
+      }
+      int occluded = intersect_scene4(scene, rays, interiors, grouped);
+      for (int j = 0; j < grouped; j++) {
+        int i = group[j];
+        st.Ld[i] = direct_light(st.direct[i], (occluded >> j) & 1,
+                                st.interior[i], paths[i].wavelens);
+      }
+      grouped = 0;
+    };
+    for (int i : st.live) {
+      if (!st.hit[i]) continue;
+      if (depth == 0 && st.direct[i].sampled && st.direct[i].has_ray) {
+        group[grouped++] = i;
+        if (grouped == 4) trace_group();
+      }
+      else {
+        st.Ld[i] = trace_direct(scene, st.direct[i], st.interior[i],
+                                paths[i].wavelens);
+      }
+    }
+    if (grouped > 0) trace_group();
+
+    // Accumulate, and set up the next bounce of the paths that go on.
+    st.next.clear();
+    for (int i : st.live) {
+      CameraPath& path = paths[i];
+      if (depth == 0) {
+        path.ray = st.ray[i];
+        path.albedo = st.hit[i] ? st.factor[i] : SampledSpectrum(0.0f);
+      }
+      path.L += st.throughput[i] * (st.Le[i] + st.Ld[i]);
+
+      bool done = !st.hit[i] || depth == max_depth;
+      if (!done) {
+        st.throughput[i] *= st.factor[i];
+        done = !(st.throughput[i].max_value() > 0.0f);
+      }
+      if (!done && depth + 1 >= settings.rr_min_depth) {
+        float survival =
+            std::min(st.throughput[i].max_value(), settings.rr_max_survival);
+        done = path.sample.rng.uniform() >= survival;
+        if (!done) st.throughput[i] /= survival;
+      }
+      if (done) {
+        debug.end_path(st.segments[i]);
+        continue;
+      }
+
+      Ray& r = st.ray[i];
+      r.origin = r.position;
+      r.direction = st.wi[i];
+      r.tmax = 1000.0;
+      r.originator = r.hit_object;
+      st.next.push_back(i);
+    }
+    std::swap(st.live, st.next);
+  }
+  debug.nest_level = 0;
 }
@@ -1,7 +1,48 @@
 #pragma once
+#include "ray.hpp"
+#include "sampler.hpp"
+#include "spectrum.hpp"
+#include <vector>
 
-class Ray;
-class Sample;
 struct Scene;
 
-float radiance(const Scene& scene, Ray& ray, float wavelen, Sample& sample);
+struct IntegratorSettings {
+  /// Paths are never terminated by Russian roulette before this many bounces.
+  int rr_min_depth = 3;
+  /// Upper limit for the survival probability, so that even paths with high
+  /// throughput are eventually terminated.
+  float rr_max_survival = 0.95f;
+};
+
+/// Radiance arriving along `ray` at each of `wavelens`. Lane 0 is the hero
+/// wavelength, which is the only one kept after dispersion. On return `ray`
+/// holds the first hit. If `albedo` is given, it receives the weight the
+/// first bounce gave the path, or zero if the ray escaped.
+SampledSpectrum radiance(const Scene& scene, Ray& ray,
+                         const SampledSpectrum& wavelens, Sample& sample,
+                         const IntegratorSettings& settings,
+                         SampledSpectrum* albedo = nullptr);
+
+/// A camera path for radiance_wavefront().
+struct CameraPath {
+  /// The camera ray. Holds the first hit once the path is done.
+  Ray ray;
+  SampledSpectrum wavelens;
+  Sample sample;
+  /// What radiance() would return, and what it would give as the albedo.
+  SampledSpectrum L;
+  SampledSpectrum albedo;
+  /// Log the path's rays, like debug.enabled does for radiance().
+  bool debug;
+};
+
+/// Trace a batch of paths side by side. Instead of following one path to its
+/// end, each stage (intersection, sky lookup for the misses, shading grouped
+/// by material, shadow rays, accumulation) is run over all live paths before
+/// the next, so that its code and data stay in cache. Camera rays and the
+/// shadow rays from their hits are traced in packets of four, which share the
+/// traversal of the hierarchies. The result for a path is the same as from
+/// radiance(), since a sample's numbers don't depend on the order in which
+/// the samples are drawn.
+void radiance_wavefront(const Scene& scene, std::vector<CameraPath>& paths,
+                        const IntegratorSettings& settings);
@@ -10,18 +10,184 @@
 #include "skybox.hpp"
 #include "spectrum.hpp"
 #include "pupumath.hpp"
+#include "render.hpp"
 #include "ValueBlock.hpp"
+#include "bvh_cache.hpp"
+#include "checkpoint.hpp"
+#include "denoise.hpp"
 #include "util.hpp"
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
-#include <fstream>
 #include <map>
 #include <memory>
+#include <stdexcept>
+#include <thread>
 #include <tclap/CmdLine.h>
 using namespace pupumath;
 
-Scene build_scene(const std::vector<ValueBlock>& blocks)
+/// Write the image under a temporary name first, so that a viewer watching
+/// the output never sees a half written file.
+static void save_snapshot(const Framebuffer& framebuffer,
+                          const std::string& filename,
+                          ExrCompression exr_compression)
+{
+  std::string temp = filename + ".tmp";
+  framebuffer.save_as(filename, temp, exr_compression);
+  if (rename(temp.c_str(), filename.c_str()) != 0) {
+    fprintf(stderr, "warning: can't write snapshot '%s'\n", filename.c_str());
+  }
+}
+
+/// Write the averaged auxiliary buffers as images next to `filename`, in the
+/// same format. Normals and depth are raw values, so the float formats are
+/// the useful ones for them.
+static void save_aux(const Framebuffer& framebuffer,
+                     const std::string& filename,
+                     ExrCompression exr_compression)
+{
+  size_t dot = filename.find_last_of('.');
+  size_t slash = filename.find_last_of('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    dot = filename.size();
+  }
+  auto name = [&](const char* what) {
+    return filename.substr(0, dot) + "." + what + filename.substr(dot);
+  };
+
+  Framebuffer albedo(framebuffer.xres, framebuffer.yres);
+  Framebuffer normal(framebuffer.xres, framebuffer.yres);
+  Framebuffer depth(framebuffer.xres, framebuffer.yres);
+  for (int i = 0; i < framebuffer.xres * framebuffer.yres; i++) {
+    AuxPixel aux = framebuffer.aux_mean(i);
+    albedo.pixels[i].value = aux.albedo;
+    albedo.pixels[i].weight = 1;
+    normal.pixels[i].value = aux.normal;
+    normal.pixels[i].weight = 1;
+    depth.pixels[i].value = vec3(aux.depth);
+    depth.pixels[i].weight = 1;
+  }
+  albedo.save(name("albedo"), exr_compression);
+  normal.save(name("normal"), exr_compression);
+  depth.save(name("depth"), exr_compression);
+}
+
+struct ProgressiveSettings {
+  /// Seconds between snapshots, or 0 for no limit.
+  float snapshot_interval;
+  /// Passes between snapshots, or 0 for no limit.
+  int snapshot_passes;
+  std::string image_file;
+  ExrCompression exr_compression;
+  /// Written together with every snapshot, unless empty.
+  std::string checkpoint_file;
+  /// Stored in the checkpoint, see scene_file_hash().
+  uint64_t scene_hash;
+  /// Pixels stop getting samples once their relative error is below this,
+  /// or 0 to give every pixel all samples.
+  float adaptive_threshold;
+  /// Samples every pixel gets before its error estimate is trusted.
+  int adaptive_min_samples;
+};
+
+/// Render samples [first_sample, settings.samples) in passes over the whole
+/// image, writing snapshots after the interval or the number of passes,
+/// whichever comes first. Pass sizes double, but are kept short enough to
+/// fit in the snapshot interval.
+static void render_progressive(const Scene& scene,
+                               const RenderSettings& settings,
+                               const ProgressiveSettings& progressive,
+                               Framebuffer& framebuffer, int first_sample)
+{
+  using clock = std::chrono::steady_clock;
+  const float interval = progressive.snapshot_interval;
+  const int passes = progressive.snapshot_passes;
+  const bool adaptive = progressive.adaptive_threshold > 0;
+  auto start = clock::now();
+  auto last_snapshot = start;
+  int passes_since_snapshot = 0;
+  int done = first_sample;
+  int pass_size = 1;
+
+  // Convergence is checked at adaptive_min_samples times powers of two, where
+  // the sample points are best stratified. Passes end at every check, so the
+  // result doesn't depend on how samples are split into passes. A pixel is
+  // active while it has all samples done so far, which also holds after
+  // resuming.
+  const int first_check = std::max(1, progressive.adaptive_min_samples);
+  auto next_check = [&](int samples) {
+    int check = first_check;
+    while (check <= samples) check *= 2;
+    return check;
+  };
+  std::vector<bool> active(settings.width * settings.height, true);
+  int active_count = active.size();
+  auto update_active = [&]() {
+    if (!adaptive) return;
+    bool check = done > 0 && next_check(done - 1) == done;
+    active_count = 0;
+    for (size_t i = 0; i < active.size(); i++) {
+      const Pixel& pixel = framebuffer.pixels[i];
+      active[i] = int(pixel.samples + 0.5f) == done &&
+                  !(check && pixel.relative_error() <=
+                                 progressive.adaptive_threshold);
+      active_count += active[i];
+    }
+  };
+  update_active();
+
+  for (int pass = 1; done < settings.samples && active_count > 0; pass++) {
+    auto pass_start = clock::now();
+    int begin = done;
+    done = std::min(settings.samples, done + pass_size);
+    if (adaptive) {
+      done = std::min(done, next_check(begin));
+    }
+    render_pass(scene, settings, framebuffer, begin, done,
+                adaptive ? &active : nullptr);
+    passes_since_snapshot++;
+    update_active();
+
+    auto now = clock::now();
+    double elapsed = std::chrono::duration<double>(now - start).count();
+    double since_snapshot =
+        std::chrono::duration<double>(now - last_snapshot).count();
+    printf("Pass %d: %d/%d samples/pixel, ", pass, done, settings.samples);
+    if (adaptive) printf("%d pixels active, ", active_count);
+    printf("%.1f seconds\n", elapsed);
+    fflush(stdout);
+
+    if (done < settings.samples && active_count > 0 &&
+        ((interval > 0 && since_snapshot >= interval) ||
+         (passes > 0 && passes_since_snapshot >= passes))) {
+      save_snapshot(framebuffer, progressive.image_file,
+                    progressive.exr_compression);
+      if (!progressive.checkpoint_file.empty()) {
+        try {
+          write_checkpoint(progressive.checkpoint_file, settings,
+                           progressive.scene_hash, done, framebuffer);
+        }
+        catch (const std::runtime_error& e) {
+          fprintf(stderr, "warning: %s\n", e.what());
+        }
+      }
+      last_snapshot = now;
+      passes_since_snapshot = 0;
+    }
+
+    // Passes get cheaper as pixels converge, so go by the last one.
+    double pass_time = std::chrono::duration<double>(now - pass_start).count();
+    double fit = interval / (pass_time / (done - begin));
+    pass_size *= 2;
+    if (interval > 0 && fit < pass_size) {
+      pass_size = std::max(1, int(fit));
+    }
+  }
+}
+
+Scene build_scene(const std::vector<ValueBlock>& blocks, BvhCache* cache)
 {
   Scene scene;
   std::map<std::string, std::shared_ptr<Material>> materials;
@@ -32,7 +198,7 @@ Scene build_scene(const std::vector<ValueBlock>& blocks)
       materials[block.id] = build_material(block);
     }
     else if (block.type == "shape") {
-      shapes[block.id] = build_shape(block);
+      shapes[block.id] = build_shape(block, cache);
     }
     else if (block.type == "skybox") {
       scene.skybox = build_skybox(block);
@@ -50,6 +216,8 @@ Scene build_scene(const std::vector<ValueBlock>& blocks)
       scene.camera = build_camera(block);
     }
   }
+  scene.build_bvh();
+  scene.build_lights();
   return scene;
 }
 
@@ -109,8 +277,73 @@ int main(int argc, char* argv[])
       "input", "Input file", "test.ascn", "???", "scene file", cmd);
   TCLAP::ValueArg<std::string> output_file_arg("o", "output", "Output file",
                                                false, "foo.ppm", "file", cmd);
+  TCLAP::ValueArg<std::string> exr_compression_arg(
+      "", "exr-compression", "Compression of .exr output", false, "zip",
+      "none|zip", cmd);
   TCLAP::ValueArg<std::string> sampler_arg("", "sampler", "Sampler", false,
-                                           "lhs", "libcrandom|lhs", cmd);
+                                           "sobol", "libcrandom|lhs|sobol", cmd);
+  TCLAP::ValueArg<std::string> filter_arg(
+      "", "filter", "Pixel reconstruction filter", false, "gaussian",
+      "box|gaussian|mitchell|blackman-harris", cmd);
+  TCLAP::ValueArg<float> filter_radius_arg(
+      "", "filter-radius", "Filter radius in pixels (0 = filter's default)",
+      false, 0.0f, "float", cmd);
+  TCLAP::ValueArg<int> threads_arg("", "threads",
+                                   "Render threads (0 = all cores)", false, 0,
+                                   "int", cmd);
+  TCLAP::ValueArg<int> tile_size_arg("", "tile-size", "Tile size in pixels",
+                                     false, 16, "int", cmd);
+  TCLAP::ValueArg<int> rr_depth_arg(
+      "", "rr-depth", "Bounces before Russian roulette starts", false, 3, "int",
+      cmd);
+  TCLAP::ValueArg<float> rr_max_survival_arg(
+      "", "rr-max-survival", "Upper limit of Russian roulette survival probability",
+      false, 0.95f, "float", cmd);
+  TCLAP::SwitchArg wavefront_arg(
+      "", "wavefront",
+      "Trace paths in large batches, one stage at a time, instead of one "
+      "path at a time",
+      cmd);
+  TCLAP::ValueArg<std::string> convert_arg(
+      "", "convert", "Write the scene in binary form to the file and exit",
+      false, "", "file", cmd);
+  TCLAP::SwitchArg progressive_arg(
+      "", "progressive",
+      "Render in passes over the whole image and write snapshots", cmd);
+  TCLAP::ValueArg<float> snapshot_interval_arg(
+      "", "snapshot-interval",
+      "Seconds between progressive snapshots (0 = no limit)", false, 60.0f,
+      "float", cmd);
+  TCLAP::ValueArg<int> snapshot_passes_arg(
+      "", "snapshot-passes",
+      "Progressive passes between snapshots (0 = no limit)", false, 0, "int",
+      cmd);
+  TCLAP::ValueArg<float> adaptive_threshold_arg(
+      "", "adaptive-threshold",
+      "Stop sampling pixels whose relative error is below this; --samples "
+      "becomes the maximum (implies --progressive)",
+      false, 0.0f, "float", cmd);
+  TCLAP::ValueArg<int> adaptive_min_samples_arg(
+      "", "adaptive-min-samples",
+      "Samples per pixel before adaptive sampling starts", false, 16, "int",
+      cmd);
+  TCLAP::ValueArg<std::string> checkpoint_arg(
+      "", "checkpoint",
+      "Save progress to the file with every snapshot (implies --progressive)",
+      false, "", "file", cmd);
+  TCLAP::SwitchArg resume_arg(
+      "", "resume", "Continue the render saved in the --checkpoint file", cmd);
+  TCLAP::SwitchArg denoise_arg(
+      "", "denoise", "Denoise the final image using the auxiliary buffers",
+      cmd);
+  TCLAP::SwitchArg aux_arg(
+      "", "aux",
+      "Also write the albedo, normals and depth of the first hits, named "
+      "after the output file (e.g. foo.albedo.exr)",
+      cmd);
+  TCLAP::SwitchArg no_bvh_cache_arg(
+      "", "no-bvh-cache",
+      "Don't read or write mesh hierarchies in <input>.bvhcache", cmd);
   TCLAP::SwitchArg test_spectrum_arg("", "test-spectrum", "Test spectrum", cmd);
   TCLAP::SwitchArg help_arg("", "help", "Show this help message", cmd);
 
@@ -126,62 +359,125 @@ int main(int argc, char* argv[])
     return 0;
   }
 
-  std::ifstream infile(input_file_arg.getValue());
-  auto blocks = read_valueblock_file(infile);
+  ExrCompression exr_compression;
+  if (exr_compression_arg.getValue() == "zip") {
+    exr_compression = ExrCompression::zip;
+  }
+  else if (exr_compression_arg.getValue() == "none") {
+    exr_compression = ExrCompression::none;
+  }
+  else {
+    fprintf(stderr, "error: unknown EXR compression '%s'\n",
+            exr_compression_arg.getValue().c_str());
+    return 1;
+  }
+
+  if (resume_arg.getValue() && !checkpoint_arg.isSet()) {
+    fprintf(stderr, "error: --resume needs --checkpoint\n");
+    return 1;
+  }
+
+  if (tile_size_arg.getValue() < 1) {
+    fprintf(stderr, "error: --tile-size must be at least 1\n");
+    return 1;
+  }
+
+  if (rr_depth_arg.getValue() < 0) {
+    fprintf(stderr, "error: --rr-depth can't be negative\n");
+    return 1;
+  }
+
+  const float max_survival = rr_max_survival_arg.getValue();
+  if (!(max_survival > 0 && max_survival <= 1)) {
+    fprintf(stderr, "error: --rr-max-survival must be in (0, 1]\n");
+    return 1;
+  }
+
+  auto blocks = read_valueblock_file(input_file_arg.getValue());
+  if (convert_arg.isSet()) {
+    write_valueblock_binary(blocks, convert_arg.getValue());
+    return 0;
+  }
   // for (const auto& block : blocks) {
   //   std::cout << block;
   // }
-  Scene scene = build_scene(blocks);
+  std::unique_ptr<BvhCache> bvh_cache;
+  if (!no_bvh_cache_arg.getValue()) {
+    bvh_cache.reset(new BvhCache(input_file_arg.getValue() + ".bvhcache"));
+  }
+  Scene scene = build_scene(blocks, bvh_cache.get());
 
   int W = width_arg.getValue();
   int H = height_arg.getValue();
   int S = samples_arg.getValue();
-  printf("Rendering %dx%d with %d samples/pixel\n", W, H, S);
+  int threads = threads_arg.getValue();
+  if (threads <= 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  printf("Rendering %dx%d with %d samples/pixel on %d threads\n", W, H, S,
+         threads);
   Framebuffer framebuffer(W, H);
-  std::shared_ptr<Sampler> sampler = create_sampler(S, sampler_arg.getValue());
+  RenderSettings settings = {W,
+                             H,
+                             S,
+                             sampler_arg.getValue(),
+                             filter_arg.getValue(),
+                             filter_radius_arg.getValue(),
+                             threads,
+                             tile_size_arg.getValue(),
+                             {rr_depth_arg.getValue(),
+                              rr_max_survival_arg.getValue()},
+                             wavefront_arg.getValue()};
+  uint64_t scene_hash = 0;
+  if (checkpoint_arg.isSet()) {
+    scene_hash = scene_file_hash(input_file_arg.getValue());
+  }
+  int first_sample = 0;
+  if (resume_arg.getValue()) {
+    first_sample = read_checkpoint(checkpoint_arg.getValue(), settings,
+                                   scene_hash, framebuffer);
+    printf("Resuming from %d samples/pixel\n", first_sample);
+  }
   auto start = std::chrono::system_clock::now();
-// #define SINGLE
-#ifdef SINGLE
-  constexpr int x0 = 50;
-  constexpr int y0 = 70;
-  for (int y = y0; y < y0 + 1; y++) {
-    for (int x = x0; x < x0 + 1; x++) {
-#else
-  for (int y = 0; y < H; y++) {
-    for (int x = 0; x < W; x++) {
-#endif
-      sampler->generate();
-      for (int s = 0; s < S; s++) {
-        debug.begin_path();
-        debug.enabled = (x == 100 && y == 100 && s == 0);
-        auto sample = Sample(sampler.get(), s);
-        float wavelen = sample.wavelen();
-        CameraSample camsamp =
-            scene.camera->project(vec2{(float(x + .5) / W * 2 - 1) * W / H,
-                                       -(float(y + .5) / H * 2 - 1)},
-                                  wavelen, sample.lens());
-        Ray ray = {camsamp.origin, camsamp.direction, 1000.0, nullptr};
-        float L = radiance(scene, ray, wavelen, sample);
-// printf("--> L=%f\n", L);
-#ifdef SINGLE
-        L = 1000;
-#endif
-        debug.end_path();
-        vec3 rgb = spectrum_ns::xyz_to_linear_rgb(
-            spectrum_ns::spectrum_sample_to_xyz(wavelen, L));
-        framebuffer.add_sample(x, y, rgb);
-      }
-      // printf("%c", '0'+int(9*L));
+  if (progressive_arg.getValue() || checkpoint_arg.isSet() ||
+      adaptive_threshold_arg.getValue() > 0) {
+    if (settings.sampler == "lhs") {
+      fprintf(stderr, "warning: lhs generates its tables for all samples "
+                      "again on every pass, which makes progressive "
+                      "rendering slower\n");
     }
-    // printf("\n");
+    ProgressiveSettings progressive = {snapshot_interval_arg.getValue(),
+                                       snapshot_passes_arg.getValue(),
+                                       output_file_arg.getValue(),
+                                       exr_compression,
+                                       checkpoint_arg.getValue(),
+                                       scene_hash,
+                                       adaptive_threshold_arg.getValue(),
+                                       adaptive_min_samples_arg.getValue()};
+    render_progressive(scene, settings, progressive, framebuffer,
+                       first_sample);
+  }
+  else {
+    render(scene, settings, framebuffer);
   }
   auto end = std::chrono::system_clock::now();
   std::chrono::duration<double> elapsed = end - start;
   printf("Rendered in %.1f seconds\n", elapsed.count());
-  framebuffer.save_ppm(output_file_arg.getValue());
+  if (aux_arg.getValue()) {
+    save_aux(framebuffer, output_file_arg.getValue(), exr_compression);
+  }
+  if (denoise_arg.getValue()) {
+    auto start = std::chrono::system_clock::now();
+    denoise(framebuffer, threads);
+    std::chrono::duration<double> elapsed =
+        std::chrono::system_clock::now() - start;
+    printf("Denoised in %.2f seconds\n", elapsed.count());
+  }
+  framebuffer.save(output_file_arg.getValue(), exr_compression);
 
   printf("Total paths: %d\n", debug.paths);
   printf("Total rays: %d\n", debug.total_rays);
+  printf("Rays/second: %.0f\n", debug.total_rays / elapsed.count());
   printf("Mean rays/path: %.1f\n", float(debug.total_rays) / debug.paths);
   printf("Min rays/path: %d\n", debug.min_path_length);
   printf("Max rays/path: %d\n", debug.max_path_length);
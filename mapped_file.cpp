@@ -0,0 +1,54 @@
+#include "mapped_file.hpp"
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& filename, Access access)
+    : data(nullptr), length(0)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("cannot open '" + filename + "'");
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("cannot stat '" + filename + "'");
+  }
+
+  length = st.st_size;
+  if (length > 0) {
+    void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("cannot map '" + filename + "'");
+    }
+    data = static_cast<const char*>(p);
+    advise(access);
+  }
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+}
+
+void MappedFile::advise(Access access) const
+{
+  if (!data) return;
+  void* p = const_cast<char*>(data);
+  if (access == sequential) {
+    madvise(p, length, MADV_SEQUENTIAL);
+  }
+  else {
+    // No read-ahead around faults, but fetch the whole file up front since
+    // all of it will be needed.
+    madvise(p, length, MADV_RANDOM);
+    madvise(p, length, MADV_WILLNEED);
+  }
+}
+
+MappedFile::~MappedFile()
+{
+  if (data) munmap(const_cast<char*>(data), length);
+}
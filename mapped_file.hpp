@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+/// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+  /// How the mapping will be read, passed on to the kernel.
+  enum Access {
+    /// Parsed once, front to back.
+    sequential,
+    /// Kept around and read in no particular order, like scene data that the
+    /// renderer uses directly from the mapping.
+    random
+  };
+
+  explicit MappedFile(const std::string& filename,
+                      Access access = sequential);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* begin() const { return data; }
+  const char* end() const { return data + length; }
+  size_t size() const { return length; }
+
+  /// Change the access advice, for example once the contents turn out to be
+  /// scene data.
+  void advise(Access access) const;
+
+private:
+  const char* data;
+  size_t length;
+};
@@ -2,12 +2,13 @@
 #include "pupumath.hpp"
 #include "util.hpp"
 #include "ValueBlock.hpp"
+#include <stdexcept>
 using namespace pupumath;
 
-float Material::absorb(float t, float wavelen) const
+SampledSpectrum Material::absorb(float t,
+                                const SampledSpectrum& wavelens) const
 {
-  float a = absorbance.sample(wavelen);
-  return exp(-t * a);
+  return exp(absorbance.sample(wavelens) * -t);
 }
 
 float brdf_lambertian(const vec3& wo, vec3& wi, float& pdf, float u1, float u2)
@@ -39,7 +40,8 @@ float brdf_transparent(const vec3& wo, vec3& wi, float& pdf)
   return 1.0 / abs_cos_theta(wi);
 }
 
-float bxdf_dielectric(const vec3& wo, vec3& wi, float& pdf, float n1, float n2)
+float bxdf_dielectric(const vec3& wo, vec3& wi, float& pdf, float n1, float n2,
+                      float u)
 {
   // Assume that the ray always comes from n1 to n2, regardless of normal
   // direction.
@@ -86,7 +88,7 @@ float bxdf_dielectric(const vec3& wo, vec3& wi, float& pdf, float n1, float n2)
 
   // printf("Rs %f  Rp %f\n", Rs, Rp);
 
-  if (frand() < .5) {
+  if (u < .5) {
     // printf("reflection %f\n", R);
     wi = vec3{-wo.x, -wo.y, wo.z};
     pdf = .5;
@@ -110,12 +112,28 @@ public:
 
   Spectrum reflectance;
 
-  float fr(const vec3& wo, vec3& wi, float wavelen,
-           float surrounding_refractive_index, float& pdf, float u1,
-           float u2) const
+  SampledSpectrum fr(const vec3& wo, vec3& wi,
+                     const SampledSpectrum& wavelens,
+                     const SampledSpectrum& surrounding_refractive_index,
+                     float& pdf, float u1, float u2) const
   {
-    return reflectance.sample(wavelen) * brdf_lambertian(wo, wi, pdf, u1, u2);
+    return reflectance.sample(wavelens) * brdf_lambertian(wo, wi, pdf, u1, u2);
   }
+
+  SampledSpectrum f(const vec3& wo, const vec3& wi,
+                    const SampledSpectrum& wavelens) const
+  {
+    if (cos_theta(wo) * cos_theta(wi) <= 0) return SampledSpectrum(0.0f);
+    return reflectance.sample(wavelens) * float(1 / M_PI);
+  }
+
+  float pdf(const vec3& wo, const vec3& wi) const
+  {
+    if (cos_theta(wo) * cos_theta(wi) <= 0) return 0.0f;
+    return abs_cos_theta(wi) / M_PI;
+  }
+
+  bool is_delta() const { return false; }
 };
 
 class PerfectMirror : public Material {
@@ -124,11 +142,12 @@ public:
 
   Spectrum reflectance;
 
-  float fr(const vec3& wo, vec3& wi, float wavelen,
-           float surrounding_refractive_index, float& pdf, float u1,
-           float u2) const
+  SampledSpectrum fr(const vec3& wo, vec3& wi,
+                     const SampledSpectrum& wavelens,
+                     const SampledSpectrum& surrounding_refractive_index,
+                     float& pdf, float u1, float u2) const
   {
-    return reflectance.sample(wavelen) *
+    return reflectance.sample(wavelens) *
            brdf_perfect_specular_reflection(wo, wi, pdf, u1, u2);
   }
 };
@@ -142,16 +161,24 @@ public:
     this->absorbance = absorbance;
   }
 
-  float fr(const vec3& wo, vec3& wi, float wavelen,
-           float surrounding_refractive_index, float& pdf, float u1,
-           float u2) const
+  SampledSpectrum fr(const vec3& wo, vec3& wi,
+                     const SampledSpectrum& wavelens,
+                     const SampledSpectrum& surrounding_refractive_index,
+                     float& pdf, float u1, float u2) const
   {
-    float n1 = surrounding_refractive_index;
-    float n2 = refractive_index.sample(wavelen);
+    SampledSpectrum n1 = surrounding_refractive_index;
+    SampledSpectrum n2 = refractive_index.sample(wavelens);
     if (wo.z < 0) {
       std::swap(n1, n2);
     }
-    return bxdf_dielectric(wo, wi, pdf, n1, n2);
+    return SampledSpectrum(bxdf_dielectric(wo, wi, pdf, n1[0], n2[0], u1));
+  }
+
+  bool disperses(const SampledSpectrum& wavelens,
+                 const SampledSpectrum& surrounding_refractive_index) const
+  {
+    return !surrounding_refractive_index.is_constant() ||
+           !refractive_index.sample(wavelens).is_constant();
   }
 };
 
@@ -168,13 +195,14 @@ public:
     this->absorbance = absorbance;
   }
 
-  float fr(const vec3& wo, vec3& wi, float wavelen,
-           float surrounding_refractive_index, float& pdf, float u1,
-           float u2) const
+  SampledSpectrum fr(const vec3& wo, vec3& wi,
+                     const SampledSpectrum& wavelens,
+                     const SampledSpectrum& surrounding_refractive_index,
+                     float& pdf, float u1, float u2) const
   {
     wi = -wo;
     pdf = 1.0;
-    return 1.0 / abs_cos_theta(wi);
+    return SampledSpectrum(1.0 / abs_cos_theta(wi));
   }
 };
 
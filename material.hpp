@@ -17,11 +17,41 @@ public:
   Spectrum absorbance;
   Spectrum emittance;
 
-  virtual float fr(const pupumath::vec3& wo, pupumath::vec3& wi, float wavelen,
-                   float surrounding_refractive_index, float& pdf, float u1,
-                   float u2) const = 0;
+  /// Sample `wi` and return the BSDF value for all wavelengths. Materials
+  /// that disperse pick the direction for the hero wavelength (lane 0).
+  virtual SampledSpectrum fr(const pupumath::vec3& wo, pupumath::vec3& wi,
+                             const SampledSpectrum& wavelens,
+                             const SampledSpectrum& surrounding_refractive_index,
+                             float& pdf, float u1, float u2) const = 0;
 
-  float absorb(float t, float wavelen) const;
+  /// Evaluate the BSDF for a given pair of directions. Zero for materials
+  /// that only scatter into discrete directions.
+  virtual SampledSpectrum f(const pupumath::vec3& wo, const pupumath::vec3& wi,
+                            const SampledSpectrum& wavelens) const
+  {
+    return SampledSpectrum(0.0f);
+  }
+
+  /// Density with which `fr` samples `wi` for the given `wo`, per unit solid
+  /// angle. Zero for delta distributions.
+  virtual float pdf(const pupumath::vec3& wo, const pupumath::vec3& wi) const
+  {
+    return 0.0f;
+  }
+
+  /// True if the scattered direction depends on the wavelength, in which
+  /// case only the hero wavelength can follow it.
+  virtual bool disperses(const SampledSpectrum& wavelens,
+                         const SampledSpectrum& surrounding_refractive_index) const
+  {
+    return false;
+  }
+
+  /// True if the BSDF is a set of delta functions (mirrors, dielectrics),
+  /// so that it can't be sampled towards a light.
+  virtual bool is_delta() const { return true; }
+
+  SampledSpectrum absorb(float t, const SampledSpectrum& wavelens) const;
 };
 
 class ValueBlock;
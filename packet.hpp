@@ -0,0 +1,76 @@
+#pragma once
+// Four rays traced together, one per float4 lane. The arithmetic follows
+// pupumath's operation for operation, so a lane gives the same result as the
+// scalar code would for its ray.
+#include "pupumath.hpp"
+#include "simd.hpp"
+
+/// Four vec3s, one per lane.
+struct vec3x4 {
+  float4 x, y, z;
+
+  vec3x4() {}
+  vec3x4(float4 x, float4 y, float4 z) : x(x), y(y), z(z) {}
+  /// The same vector in every lane.
+  explicit vec3x4(const pupumath::vec3& v) : x(v.x), y(v.y), z(v.z) {}
+
+  float4 operator[](int i) const { return i == 0 ? x : i == 1 ? y : z; }
+
+  pupumath::vec3 lane(int i) const { return {x[i], y[i], z[i]}; }
+  void set_lane(int i, const pupumath::vec3& v)
+  {
+    x[i] = v.x;
+    y[i] = v.y;
+    z[i] = v.z;
+  }
+};
+
+inline vec3x4 operator+(const vec3x4& a, const vec3x4& b)
+{
+  return {a.x + b.x, a.y + b.y, a.z + b.z};
+}
+
+inline vec3x4 operator-(const vec3x4& a, const vec3x4& b)
+{
+  return {a.x - b.x, a.y - b.y, a.z - b.z};
+}
+
+inline vec3x4 operator*(const vec3x4& a, float4 f)
+{
+  return {a.x * f, a.y * f, a.z * f};
+}
+
+inline vec3x4 operator/(const vec3x4& a, float4 f)
+{
+  return {a.x / f, a.y / f, a.z / f};
+}
+
+inline float4 dot(const vec3x4& a, const vec3x4& b)
+{
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline vec3x4 cross(const vec3x4& a, const vec3x4& b)
+{
+  return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
+          a.x * b.y - a.y * b.x};
+}
+
+inline vec3x4 normalize(const vec3x4& v) { return v / sqrt(dot(v, v)); }
+
+inline vec3x4 select(mask4 mask, const vec3x4& a, const vec3x4& b)
+{
+  return {select(mask, a.x, b.x), select(mask, a.y, b.y),
+          select(mask, a.z, b.z)};
+}
+
+/// Object space rays for Shape::intersect4(). Like Ray, a hit shrinks `tmax`
+/// and sets `position` and `normal` of its lane.
+struct RayPacket {
+  vec3x4 origin;
+  vec3x4 direction;
+  float4 tmax;
+
+  vec3x4 position;
+  vec3x4 normal;
+};
@@ -0,0 +1,146 @@
+#pragma once
+// Number parsing on raw character ranges, in the spirit of std::from_chars.
+// The functions read from `p`, never look at or beyond `end` and advance `p`
+// past the parsed characters. They return false if no number was found.
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace parse {
+
+inline bool is_space(char c)
+{
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' ||
+         c == '\v';
+}
+
+inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+inline void skip_space(const char*& p, const char* end)
+{
+  while (p < end && is_space(*p)) ++p;
+}
+
+/// Skip leading whitespace and return the next whitespace delimited token.
+inline bool next_token(const char*& p, const char* end, const char*& begin,
+                       const char*& token_end)
+{
+  skip_space(p, end);
+  begin = p;
+  while (p < end && !is_space(*p)) ++p;
+  token_end = p;
+  return begin != token_end;
+}
+
+inline bool parse_int(const char*& p, const char* end, long long& value)
+{
+  const char* s = p;
+  bool neg = false;
+  if (s < end && (*s == '-' || *s == '+')) {
+    neg = (*s == '-');
+    ++s;
+  }
+  if (s == end || !is_digit(*s)) return false;
+  unsigned long long v = 0;
+  while (s < end && is_digit(*s)) {
+    v = v * 10 + (*s - '0');
+    ++s;
+  }
+  value = neg ? -static_cast<long long>(v) : static_cast<long long>(v);
+  p = s;
+  return true;
+}
+
+/// Parse a decimal floating point number. Numbers with at most
+/// `exact_digits` significant digits and a small exponent are converted with
+/// a single multiplication or division (Clinger's fast path), which is exact
+/// for up to 15 digits; everything else falls back to strtod.
+inline bool parse_decimal(const char*& p, const char* end, double& value,
+                          int exact_digits)
+{
+  static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                 1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                 1e18, 1e19, 1e20, 1e21, 1e22};
+  const char* s = p;
+  bool neg = false;
+  if (s < end && (*s == '-' || *s == '+')) {
+    neg = (*s == '-');
+    ++s;
+  }
+
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool any = false;
+  while (s < end && is_digit(*s)) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*s - '0');
+      if (mantissa) ++digits;
+    }
+    else {
+      ++exponent;
+    }
+    any = true;
+    ++s;
+  }
+  if (s < end && *s == '.') {
+    ++s;
+    while (s < end && is_digit(*s)) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*s - '0');
+        if (mantissa) ++digits;
+        --exponent;
+      }
+      any = true;
+      ++s;
+    }
+  }
+  if (!any) return false;
+
+  if (s < end && (*s == 'e' || *s == 'E')) {
+    const char* e = s + 1;
+    long long exp;
+    if (parse_int(e, end, exp)) {
+      if (exp > 100000) exp = 100000;
+      if (exp < -100000) exp = -100000;
+      exponent += exp;
+      s = e;
+    }
+  }
+
+  if (digits <= exact_digits && exponent >= -22 && exponent <= 22) {
+    double v = static_cast<double>(mantissa);
+    v = exponent < 0 ? v / pow10[-exponent] : v * pow10[exponent];
+    value = neg ? -v : v;
+  }
+  else {
+    // Rare slow path: hand a terminated copy of the token to the C library.
+    char buffer[64];
+    size_t len = s - p;
+    if (len >= sizeof(buffer)) return false;
+    memcpy(buffer, p, len);
+    buffer[len] = '\0';
+    value = strtod(buffer, nullptr);
+  }
+  p = s;
+  return true;
+}
+
+inline bool parse_double(const char*& p, const char* end, double& value)
+{
+  return parse_decimal(p, end, value, 15);
+}
+
+/// Like parse_double, but keeps the fast path for up to 19 digits (exported
+/// meshes often print 17). The double result is within an ulp or so of the
+/// exact value, which is far below float precision.
+inline bool parse_float(const char*& p, const char* end, float& value)
+{
+  double v;
+  if (!parse_decimal(p, end, v, 19)) return false;
+  value = static_cast<float>(v);
+  return true;
+}
+
+} // namespace parse
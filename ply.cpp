@@ -0,0 +1,347 @@
+#include "ply.hpp"
+#include "mapped_file.hpp"
+#include "parse.hpp"
+#include <cstring>
+#include <stdexcept>
+using pupumath::vec3;
+
+namespace ply_ns {
+
+enum class Format { ascii, binary_little_endian, binary_big_endian };
+
+enum class Type { int8, uint8, int16, uint16, int32, uint32, float32, float64 };
+
+struct Property {
+  std::string name;
+  Type type;
+  bool is_list;
+  Type count_type;
+};
+
+struct Element {
+  std::string name;
+  size_t count;
+  std::vector<Property> properties;
+
+  int find(const std::string& name) const
+  {
+    for (size_t i = 0; i < properties.size(); i++) {
+      if (properties[i].name == name) return i;
+    }
+    return -1;
+  }
+};
+
+int type_size(Type type)
+{
+  switch (type) {
+  case Type::int8:
+  case Type::uint8: return 1;
+  case Type::int16:
+  case Type::uint16: return 2;
+  case Type::int32:
+  case Type::uint32:
+  case Type::float32: return 4;
+  case Type::float64: return 8;
+  }
+  return 0;
+}
+
+Type parse_type(const std::string& name, const std::string& filename)
+{
+  if (name == "char" || name == "int8") return Type::int8;
+  if (name == "uchar" || name == "uint8") return Type::uint8;
+  if (name == "short" || name == "int16") return Type::int16;
+  if (name == "ushort" || name == "uint16") return Type::uint16;
+  if (name == "int" || name == "int32") return Type::int32;
+  if (name == "uint" || name == "uint32") return Type::uint32;
+  if (name == "float" || name == "float32") return Type::float32;
+  if (name == "double" || name == "float64") return Type::float64;
+  throw std::runtime_error("ply '" + filename + "': unknown type '" + name +
+                           "'");
+}
+
+bool host_is_little_endian()
+{
+  const uint16_t one = 1;
+  uint8_t first;
+  memcpy(&first, &one, 1);
+  return first == 1;
+}
+
+template <typename T>
+T load(const unsigned char* bytes)
+{
+  T v;
+  memcpy(&v, bytes, sizeof(T));
+  return v;
+}
+
+/// Reads values from the data section of the file.
+class Reader {
+public:
+  Reader(const char* p, const char* end, Format format,
+         const std::string& filename)
+      : p(p), end(end), format(format), filename(filename),
+        swap(format != Format::ascii &&
+             (format == Format::binary_little_endian) !=
+                 host_is_little_endian())
+  {
+  }
+
+  double read(Type type)
+  {
+    if (format == Format::ascii) {
+      double v;
+      parse::skip_space(p, end);
+      if (!parse::parse_double(p, end, v)) fail("expected a number");
+      return v;
+    }
+
+    int size = type_size(type);
+    if (end - p < size) fail("unexpected end of file");
+    unsigned char bytes[8];
+    memcpy(bytes, p, size);
+    p += size;
+    if (swap) {
+      for (int i = 0; i < size / 2; i++) std::swap(bytes[i], bytes[size - 1 - i]);
+    }
+    switch (type) {
+    case Type::int8: return load<int8_t>(bytes);
+    case Type::uint8: return load<uint8_t>(bytes);
+    case Type::int16: return load<int16_t>(bytes);
+    case Type::uint16: return load<uint16_t>(bytes);
+    case Type::int32: return load<int32_t>(bytes);
+    case Type::uint32: return load<uint32_t>(bytes);
+    case Type::float32: return load<float>(bytes);
+    case Type::float64: return load<double>(bytes);
+    }
+    return 0;
+  }
+
+  /// Read every property of one element instance. Scalars go to `values`
+  /// (indexed by property), the items of the list property `list_index`
+  /// go to `list`.
+  void read_instance(const Element& element, double* values, int list_index,
+                     std::vector<int>& list)
+  {
+    for (size_t i = 0; i < element.properties.size(); i++) {
+      const Property& prop = element.properties[i];
+      if (!prop.is_list) {
+        values[i] = read(prop.type);
+        continue;
+      }
+      size_t count = read(prop.count_type);
+      if (int(i) == list_index) {
+        list.resize(count);
+        for (auto& item : list) item = read(prop.type);
+      }
+      else {
+        for (size_t k = 0; k < count; k++) read(prop.type);
+      }
+    }
+  }
+
+  /// Fast path for binary elements made of fixed size properties only:
+  /// returns the record size, or 0 if the element has list properties.
+  int record_size(const Element& element) const
+  {
+    if (format == Format::ascii) return 0;
+    int size = 0;
+    for (const auto& prop : element.properties) {
+      if (prop.is_list) return 0;
+      size += type_size(prop.type);
+    }
+    return size;
+  }
+
+  const char* p;
+  const char* end;
+  Format format;
+  const std::string& filename;
+  bool swap;
+
+  [[noreturn]] void fail(const std::string& what) const
+  {
+    throw std::runtime_error("ply '" + filename + "': " + what);
+  }
+};
+
+void read_vertices(Reader& reader, const Element& element, PlyMesh& mesh)
+{
+  int xyz[3] = {element.find("x"), element.find("y"), element.find("z")};
+  if (xyz[0] < 0 || xyz[1] < 0 || xyz[2] < 0) {
+    reader.fail("vertex element without x, y and z");
+  }
+  mesh.vertices.resize(element.count);
+
+  int stride = reader.record_size(element);
+  bool packed_floats = stride > 0 && !reader.swap;
+  for (int k = 0; k < 3; k++) {
+    packed_floats = packed_floats &&
+                    element.properties[xyz[k]].type == Type::float32;
+  }
+
+  if (packed_floats) {
+    // Copy straight out of the mapping.
+    if (size_t(reader.end - reader.p) < element.count * stride) {
+      reader.fail("unexpected end of file");
+    }
+    int offset[3] = {0, 0, 0};
+    for (int k = 0; k < 3; k++) {
+      for (int i = 0; i < xyz[k]; i++) {
+        offset[k] += type_size(element.properties[i].type);
+      }
+    }
+    for (size_t i = 0; i < element.count; i++) {
+      const char* record = reader.p + i * stride;
+      for (int k = 0; k < 3; k++) {
+        memcpy(&mesh.vertices[i][k], record + offset[k], sizeof(float));
+      }
+    }
+    reader.p += element.count * stride;
+    return;
+  }
+
+  std::vector<double> values(element.properties.size());
+  std::vector<int> unused;
+  for (auto& v : mesh.vertices) {
+    reader.read_instance(element, values.data(), -1, unused);
+    v = vec3(values[xyz[0]], values[xyz[1]], values[xyz[2]]);
+  }
+}
+
+void read_faces(Reader& reader, const Element& element, PlyMesh& mesh)
+{
+  int list_index = element.find("vertex_indices");
+  if (list_index < 0) list_index = element.find("vertex_index");
+  if (list_index < 0 || !element.properties[list_index].is_list) {
+    reader.fail("face element without vertex_indices");
+  }
+
+  mesh.triangles.reserve(element.count * 3);
+  std::vector<double> values(element.properties.size());
+  std::vector<int> polygon;
+  int vertex_count = mesh.vertices.size();
+  for (size_t i = 0; i < element.count; i++) {
+    reader.read_instance(element, values.data(), list_index, polygon);
+    for (int v : polygon) {
+      if (v < 0 || v >= vertex_count) reader.fail("vertex index out of range");
+    }
+    for (size_t k = 2; k < polygon.size(); k++) {
+      mesh.triangles.push_back(polygon[0]);
+      mesh.triangles.push_back(polygon[k - 1]);
+      mesh.triangles.push_back(polygon[k]);
+    }
+  }
+}
+
+void skip_element(Reader& reader, const Element& element)
+{
+  int stride = reader.record_size(element);
+  if (stride > 0) {
+    if (size_t(reader.end - reader.p) < element.count * stride) {
+      reader.fail("unexpected end of file");
+    }
+    reader.p += element.count * stride;
+    return;
+  }
+  std::vector<double> values(element.properties.size());
+  std::vector<int> unused;
+  for (size_t i = 0; i < element.count; i++) {
+    reader.read_instance(element, values.data(), -1, unused);
+  }
+}
+
+} // namespace ply_ns
+
+using namespace ply_ns;
+
+PlyMesh read_ply(const std::string& filename)
+{
+  MappedFile file(filename);
+  const char* p = file.begin();
+  const char* end = file.end();
+
+  // Header: one keyword per line, terminated by "end_header".
+  auto next_line = [&]() {
+    const char* line_end = p;
+    while (line_end < end && *line_end != '\n') ++line_end;
+    std::string line(p, line_end);
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    p = (line_end < end) ? line_end + 1 : end;
+    return line;
+  };
+  auto words = [](const std::string& line) {
+    std::vector<std::string> result;
+    const char* q = line.data();
+    const char* q_end = q + line.size();
+    const char *begin, *token_end;
+    while (parse::next_token(q, q_end, begin, token_end)) {
+      result.emplace_back(begin, token_end);
+    }
+    return result;
+  };
+  auto fail = [&](const std::string& what) {
+    throw std::runtime_error("ply '" + filename + "': " + what);
+  };
+
+  if (next_line() != "ply") fail("not a ply file");
+
+  Format format = Format::ascii;
+  bool have_format = false;
+  std::vector<Element> elements;
+  while (true) {
+    if (p == end) fail("unterminated header");
+    auto w = words(next_line());
+    if (w.empty() || w[0] == "comment" || w[0] == "obj_info") continue;
+    if (w[0] == "end_header") break;
+
+    if (w[0] == "format" && w.size() >= 2) {
+      if (w[1] == "ascii") format = Format::ascii;
+      else if (w[1] == "binary_little_endian")
+        format = Format::binary_little_endian;
+      else if (w[1] == "binary_big_endian")
+        format = Format::binary_big_endian;
+      else
+        fail("unknown format '" + w[1] + "'");
+      have_format = true;
+    }
+    else if (w[0] == "element" && w.size() == 3) {
+      elements.push_back({w[1], std::stoul(w[2]), {}});
+    }
+    else if (w[0] == "property" && !elements.empty()) {
+      if (w.size() == 5 && w[1] == "list") {
+        elements.back().properties.push_back(
+            {w[4], parse_type(w[3], filename), true,
+             parse_type(w[2], filename)});
+      }
+      else if (w.size() == 3) {
+        elements.back().properties.push_back(
+            {w[2], parse_type(w[1], filename), false, Type::uint8});
+      }
+      else {
+        fail("malformed property");
+      }
+    }
+    else {
+      fail("unexpected header line '" + w[0] + "'");
+    }
+  }
+  if (!have_format) fail("missing format");
+
+  PlyMesh mesh;
+  Reader reader(p, end, format, filename);
+  for (const auto& element : elements) {
+    if (element.name == "vertex") {
+      read_vertices(reader, element, mesh);
+    }
+    else if (element.name == "face") {
+      read_faces(reader, element, mesh);
+    }
+    else {
+      skip_element(reader, element);
+    }
+  }
+  return mesh;
+}
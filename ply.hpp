@@ -0,0 +1,13 @@
+#pragma once
+#include "pupumath_struct.hpp"
+#include <string>
+#include <vector>
+
+struct PlyMesh {
+  std::vector<pupumath::vec3> vertices;
+  /// Three vertex indices per triangle. Polygons are triangulated as fans.
+  std::vector<int> triangles;
+};
+
+/// Load vertex positions and faces from an ASCII or binary PLY file.
+PlyMesh read_ply(const std::string& filename);
@@ -555,6 +555,65 @@ inline Transform operator*(const Transform& a, const Transform& b)
 
 inline Transform inverse(const Transform& t) { return {t.Minv, t.M}; }
 
+//// Bounds ////////////////////////////////////////////////////
+
+inline vec3 min(const vec3& a, const vec3& b)
+{
+  return vec3{std::fmin(a.x, b.x), std::fmin(a.y, b.y), std::fmin(a.z, b.z)};
+}
+
+inline vec3 max(const vec3& a, const vec3& b)
+{
+  return vec3{std::fmax(a.x, b.x), std::fmax(a.y, b.y), std::fmax(a.z, b.z)};
+}
+
+inline Bounds merge(const Bounds& a, const Bounds& b)
+{
+  return Bounds{min(a.min, b.min), max(a.max, b.max)};
+}
+
+inline Bounds merge(const Bounds& a, const vec3& p)
+{
+  return Bounds{min(a.min, p), max(a.max, p)};
+}
+
+inline vec3 extent(const Bounds& b) { return b.max - b.min; }
+
+inline vec3 centroid(const Bounds& b) { return (b.min + b.max) * 0.5f; }
+
+inline bool is_finite(const Bounds& b)
+{
+  return std::isfinite(b.min.x) && std::isfinite(b.min.y) &&
+         std::isfinite(b.min.z) && std::isfinite(b.max.x) &&
+         std::isfinite(b.max.y) && std::isfinite(b.max.z);
+}
+
+inline float surface_area(const Bounds& b)
+{
+  vec3 d = extent(b);
+  return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+/// Index of the longest axis.
+inline int max_extent_axis(const Bounds& b)
+{
+  vec3 d = extent(b);
+  if (d.x > d.y && d.x > d.z) return 0;
+  return (d.y > d.z) ? 1 : 2;
+}
+
+inline Bounds transform_bounds(const Transform& t, const Bounds& b)
+{
+  if (!is_finite(b)) return Bounds::infinite();
+  Bounds result;
+  for (int i = 0; i < 8; i++) {
+    vec3 corner{(i & 1) ? b.max.x : b.min.x, (i & 2) ? b.max.y : b.min.y,
+                (i & 4) ? b.max.z : b.min.z};
+    result = merge(result, transform_point(t, corner));
+  }
+  return result;
+}
+
 namespace new_transform {
 // clang-format off
 #pragma GCC diagnostic ignored "-Wunused-function"
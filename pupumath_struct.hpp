@@ -1,4 +1,5 @@
 #pragma once
+#include <cmath>
 
 namespace pupumath {
 struct vec2 {
@@ -73,4 +74,15 @@ struct mat34 {
 struct Transform {
   mat34 M, Minv;
 };
+
+/// Axis-aligned bounding box. Default constructed box is empty.
+struct Bounds {
+  vec3 min, max;
+
+  Bounds() : min(HUGE_VALF), max(-HUGE_VALF) {}
+  Bounds(const vec3 &p) : min(p), max(p) {}
+  Bounds(const vec3 &min, const vec3 &max) : min(min), max(max) {}
+
+  static Bounds infinite() { return Bounds(vec3(-HUGE_VALF), vec3(HUGE_VALF)); }
+};
 } // namespace pupumath
@@ -4,8 +4,8 @@
 class GeometricObject;
 
 struct Ray {
-  const pupumath::vec3 origin;
-  const pupumath::vec3 direction;
+  pupumath::vec3 origin;
+  pupumath::vec3 direction;
 
   // constraints:
   float tmax;
@@ -0,0 +1,219 @@
+#include "render.hpp"
+#include "camera.hpp"
+#include "debug.hpp"
+#include "filter.hpp"
+#include "framebuffer.hpp"
+#include "integrator.hpp"
+#include "ray.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "spectrum.hpp"
+#include "tiles.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <mutex>
+#include <thread>
+using namespace pupumath;
+
+/// Camera ray for a sample in pixel (x, y). `jitter` receives the sample's
+/// position within the pixel.
+static Ray camera_ray(const Scene& scene, const RenderSettings& settings,
+                      int x, int y, Sample& sample,
+                      const SampledSpectrum& wavelens, vec2& jitter)
+{
+  const int W = settings.width;
+  const int H = settings.height;
+  jitter = sample.film();
+  vec2 film = vec2{x + jitter.x, y + jitter.y};
+  CameraSample camsamp = scene.camera->project(
+      vec2{(film.x / W * 2 - 1) * W / H, -(film.y / H * 2 - 1)}, wavelens[0],
+      sample.lens());
+  return {camsamp.origin, camsamp.direction, 1000.0, nullptr};
+}
+
+/// Add a finished path to the tile. `ray` holds its first hit.
+static void add_path(TileBuffer& buffer, const Filter& filter, int x, int y,
+                     const vec2& jitter, const SampledSpectrum& wavelens,
+                     const SampledSpectrum& L, const Ray& ray,
+                     const SampledSpectrum& albedo)
+{
+  vec3 rgb = spectrum_ns::spectrum_sample_to_linear_rgb(wavelens, L);
+  buffer.splat(x, y, jitter, rgb, filter);
+
+  AuxPixel aux;
+  if (ray.hit_object) {
+    aux.albedo = spectrum_ns::spectrum_sample_to_linear_rgb(wavelens, albedo);
+    aux.normal = ray.normal;
+    aux.depth = norm(ray.position - ray.origin);
+  }
+  buffer.add_aux(x, y, aux);
+}
+
+static void render_tile(const Scene& scene, const RenderSettings& settings,
+                        Sampler& sampler, const Tile& tile, int first_sample,
+                        int end_sample, const std::vector<bool>* active,
+                        const Filter& filter, TileBuffer& buffer)
+{
+  const int W = settings.width;
+
+  buffer.reset(tile.x0, tile.y0, tile.x1 - tile.x0, tile.y1 - tile.y0);
+
+  for (int y = tile.y0; y < tile.y1; y++) {
+    for (int x = tile.x0; x < tile.x1; x++) {
+      if (active && !(*active)[y * W + x]) continue;
+      sampler.generate(y * W + x);
+      for (int s = first_sample; s < end_sample; s++) {
+        debug.begin_path();
+        debug.enabled = (x == 100 && y == 100 && s == 0);
+        auto sample = Sample(&sampler, s);
+        SampledSpectrum wavelens = Spectrum::wavelens(sample.wavelen());
+        vec2 jitter;
+        Ray ray = camera_ray(scene, settings, x, y, sample, wavelens, jitter);
+        SampledSpectrum albedo;
+        SampledSpectrum L = radiance(scene, ray, wavelens, sample,
+                                     settings.integrator, &albedo);
+        debug.end_path();
+        add_path(buffer, filter, x, y, jitter, wavelens, L, ray, albedo);
+      }
+    }
+  }
+}
+
+/// Paths traced together by the wavefront integrator. Enough to keep every
+/// stage busy for a while, few enough for the path state to stay in cache.
+constexpr size_t wavefront_size = 4096;
+
+/// Bytes of sampler state a thread keeps for the queued pixels. Samplers
+/// with per-pixel tables (lhs) can need a lot for many samples per pixel, so
+/// a batch is flushed early rather than taking more.
+constexpr size_t wavefront_sampler_budget = 4 << 20;
+
+/// Same as render_tile(), but with the wavefront integrator. Paths are
+/// queued in the same order and added to the tile in that order, so the
+/// result is the same.
+/// Every pixel with paths in the queue needs a sampler of its own, taken from
+/// `samplers`, which grows up to wavefront_sampler_budget.
+static void render_tile_wavefront(
+    const Scene& scene, const RenderSettings& settings,
+    std::vector<std::shared_ptr<Sampler>>& samplers, const Tile& tile,
+    int first_sample, int end_sample, const std::vector<bool>* active,
+    const Filter& filter, TileBuffer& buffer)
+{
+  const int W = settings.width;
+
+  struct FilmSample {
+    int x, y;
+    vec2 jitter;
+  };
+  static thread_local std::vector<CameraPath> paths;
+  static thread_local std::vector<FilmSample> film;
+  paths.clear();
+  film.clear();
+
+  auto flush = [&]() {
+    radiance_wavefront(scene, paths, settings.integrator);
+    for (size_t i = 0; i < paths.size(); i++) {
+      const CameraPath& path = paths[i];
+      add_path(buffer, filter, film[i].x, film[i].y, film[i].jitter,
+               path.wavelens, path.L, path.ray, path.albedo);
+    }
+    paths.clear();
+    film.clear();
+  };
+
+  buffer.reset(tile.x0, tile.y0, tile.x1 - tile.x0, tile.y1 - tile.y0);
+
+  if (samplers.empty()) {
+    samplers.push_back(create_sampler(settings.samples, settings.sampler));
+  }
+  const size_t max_samplers =
+      std::max<size_t>(1, wavefront_sampler_budget / samplers[0]->state_size());
+
+  size_t used = 0;
+  for (int y = tile.y0; y < tile.y1; y++) {
+    for (int x = tile.x0; x < tile.x1; x++) {
+      if (active && !(*active)[y * W + x]) continue;
+      if (used == max_samplers) {
+        flush();
+        used = 0;
+      }
+      if (used == samplers.size()) {
+        samplers.push_back(create_sampler(settings.samples, settings.sampler));
+      }
+      Sampler& sampler = *samplers[used++];
+      sampler.generate(y * W + x);
+      for (int s = first_sample; s < end_sample; s++) {
+        if (paths.size() == wavefront_size) {
+          flush();
+          // Only this pixel's sampler is still in use.
+          std::swap(samplers[0], samplers[used - 1]);
+          used = 1;
+        }
+        auto sample = Sample(&sampler, s);
+        SampledSpectrum wavelens = Spectrum::wavelens(sample.wavelen());
+        vec2 jitter;
+        Ray ray = camera_ray(scene, settings, x, y, sample, wavelens, jitter);
+        paths.push_back({ray, wavelens, sample});
+        paths.back().debug = (x == 100 && y == 100 && s == 0);
+        film.push_back({x, y, jitter});
+      }
+    }
+  }
+  if (!paths.empty()) flush();
+}
+
+void render(const Scene& scene, const RenderSettings& settings,
+            Framebuffer& framebuffer)
+{
+  render_pass(scene, settings, framebuffer, 0, settings.samples);
+}
+
+void render_pass(const Scene& scene, const RenderSettings& settings,
+                 Framebuffer& framebuffer, int first_sample, int end_sample,
+                 const std::vector<bool>* active)
+{
+  // The calling thread works too, so keep its earlier totals apart.
+  debug_t earlier = debug;
+  debug = debug_t();
+
+  auto tiles =
+      make_tiles(settings.width, settings.height, settings.tile_size);
+  TileScheduler scheduler(tiles, settings.threads);
+  std::mutex stats_mutex;
+  debug_t stats;
+  auto filter = create_filter(settings.filter, settings.filter_radius);
+
+  auto worker = [&](int id) {
+    auto sampler = create_sampler(settings.samples, settings.sampler);
+    std::vector<std::shared_ptr<Sampler>> samplers;
+    TileBuffer buffer(settings.tile_size, settings.tile_size,
+                      filter->margin());
+    Tile tile;
+    while (scheduler.next(id, tile)) {
+      if (settings.wavefront) {
+        render_tile_wavefront(scene, settings, samplers, tile, first_sample,
+                              end_sample, active, *filter, buffer);
+      }
+      else {
+        render_tile(scene, settings, *sampler, tile, first_sample,
+                    end_sample, active, *filter, buffer);
+      }
+      framebuffer.merge(buffer);
+    }
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    stats.merge(debug);
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < settings.threads; i++) {
+    threads.emplace_back(worker, i);
+  }
+  worker(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // Hand the totals to the calling thread for reporting.
+  debug = earlier;
+  debug.merge(stats);
+}
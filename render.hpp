@@ -0,0 +1,39 @@
+#pragma once
+#include "integrator.hpp"
+#include <string>
+#include <vector>
+
+class Framebuffer;
+struct Scene;
+
+struct RenderSettings {
+  int width;
+  int height;
+  int samples;
+  std::string sampler;
+  /// Reconstruction filter name and radius, 0 for the filter's default.
+  std::string filter;
+  float filter_radius;
+  int threads;
+  int tile_size;
+  IntegratorSettings integrator;
+  /// Trace paths in batches with radiance_wavefront() instead of one at a
+  /// time.
+  bool wavefront;
+};
+
+/// Render the scene into the framebuffer using `settings.threads` workers.
+/// The result does not depend on the number of threads, except for rounding
+/// where filters wider than a pixel reach across tiles.
+void render(const Scene& scene, const RenderSettings& settings,
+            Framebuffer& framebuffer);
+
+/// Add samples [first_sample, end_sample) of every pixel to the framebuffer.
+/// A sample only depends on the pixel and the sample index, so consecutive
+/// ranges add up to the same image as one call, with every sampler. Each
+/// call still generates the samplers' per-pixel state again, which is a full
+/// set of tables with lhs.
+/// If `active` is given, pixels whose flag is false are skipped.
+void render_pass(const Scene& scene, const RenderSettings& settings,
+                 Framebuffer& framebuffer, int first_sample, int end_sample,
+                 const std::vector<bool>* active = nullptr);
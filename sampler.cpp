@@ -1,94 +1,293 @@
 #include "sampler.hpp"
 #include "spectrum.hpp"
 #include "util.hpp"
+#include <stdexcept>
+#include <string>
 using pupumath::vec3;
 using pupumath::vec2;
 
+/// Independent uniform numbers, from the sample's own stream.
 struct LibCRandomSampler : public Sampler {
 
   LibCRandomSampler(int n) : Sampler(n) {}
 
-  void generate() {}
+  float get_wavelen(int sample_id, Pcg32& stream) override
+  {
+    return Spectrum::wavelen(stream.uniform());
+  }
+
+  vec2 get_film(int sample_id, Pcg32& stream) override
+  {
+    return uniform2(stream);
+  }
+
+  vec2 get_lens(int sample_id, Pcg32& stream) override
+  {
+    return uniform2(stream);
+  }
 
-  float get_wavelen(int sample_id) override
+  vec2 get_shading(int sample_id, int counter, Pcg32& stream) override
   {
-    return Spectrum::wavelen(frand());
+    return uniform2(stream);
   }
 
-  vec2 get_lens(int sample_id) override { return vec2{frand(), frand()}; }
+  vec3 get_light(int sample_id, int counter, Pcg32& stream) override
+  {
+    return vec3{stream.uniform(), stream.uniform(), stream.uniform()};
+  }
 
-  vec2 get_shading(int sample_id, int counter) override
+private:
+  static vec2 uniform2(Pcg32& stream)
   {
-    return vec2{frand(), frand()};
+    return vec2{stream.uniform(), stream.uniform()};
   }
 };
 
 struct LhsSampler : public Sampler {
   std::unique_ptr<float[]> wavelen;
+  std::unique_ptr<pupumath::vec2[]> film;
   std::unique_ptr<pupumath::vec2[]> lens;
   std::unique_ptr<pupumath::vec2[]> shading;
+  std::unique_ptr<pupumath::vec3[]> light;
 
   LhsSampler(int n)
-      : Sampler(n), wavelen(new float[n]), lens(new vec2[n]),
-        shading(new vec2[n * 4])
+      : Sampler(n), wavelen(new float[n]), film(new vec2[n]),
+        lens(new vec2[n]), shading(new vec2[n * 4]), light(new vec3[n * 4])
   {
   }
 
-  void generate() override
+  void generate_samples() override
   {
     for (int i = 0; i < n; i++) {
-      wavelen[i] = Spectrum::wavelen((i + frand()) / n);
+      wavelen[i] = Spectrum::wavelen((i + rng.uniform()) / n);
     }
 
     for (int i = 0; i < n; i++) {
-      lens[i] = vec2{frand(), frand()};
+      lens[i] = vec2{rng.uniform(), rng.uniform()};
     }
 
     const float step = 1.f / n;
     for (int k = 0; k < 4; k++) {
       for (int i = 0; i < n; i++) {
-        shading[k * n + i] = vec2{(i + frand()) * step, (i + frand()) * step};
+        shading[k * n + i] = vec2{(i + rng.uniform()) * step, (i + rng.uniform()) * step};
       }
     }
     // Shuffle u1 values -> latin hypercube.
     for (int k = 0; k < 4; k++) {
       for (int i = 0; i < n - 1; i++) {
-        int j = i + rand() % (n - i);
+        int j = i + rng.uniform_int(n - i);
         std::swap(shading[k * n + i].x, shading[k * n + j].x);
       }
     }
 
+    for (int k = 0; k < 4; k++) {
+      for (int i = 0; i < n; i++) {
+        light[k * n + i] = vec3{(i + rng.uniform()) * step, (i + rng.uniform()) * step,
+                                (i + rng.uniform()) * step};
+      }
+      for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < n - 1; i++) {
+          int j = i + rng.uniform_int(n - i);
+          std::swap(light[k * n + i][d], light[k * n + j][d]);
+        }
+      }
+    }
+
 
     // Shuffle samples so the different dimensions are not dependent.
 
     for (int i = 0; i < n - 1; i++) {
-      int j = i + rand() % (n - i);
+      int j = i + rng.uniform_int(n - i);
       std::swap(wavelen[i], wavelen[j]);
     }
 
     for (int i = 0; i < n - 1; i++) {
-      int j = i + rand() % (n - i);
+      int j = i + rng.uniform_int(n - i);
       std::swap(lens[i], lens[j]);
     }
 
     for (int k = 0; k < 4; k++) {
       for (int i = 0; i < n - 1; i++) {
-        int j = i + rand() % (n - i);
+        int j = i + rng.uniform_int(n - i);
         std::swap(shading[k * n + i], shading[k * n + j]);
       }
     }
+
+    for (int k = 0; k < 4; k++) {
+      for (int i = 0; i < n - 1; i++) {
+        int j = i + rng.uniform_int(n - i);
+        std::swap(light[k * n + i], light[k * n + j]);
+      }
+    }
+
+    // Film positions are a latin hypercube like the shading numbers.
+    for (int i = 0; i < n; i++) {
+      film[i] = vec2{(i + rng.uniform()) * step, (i + rng.uniform()) * step};
+    }
+    for (int i = 0; i < n - 1; i++) {
+      int j = i + rng.uniform_int(n - i);
+      std::swap(film[i].x, film[j].x);
+    }
+  }
+
+  size_t state_size() const override
+  {
+    return sizeof(*this) +
+           n * (sizeof(float) + 6 * sizeof(vec2) + 4 * sizeof(vec3));
+  }
+
+  float get_wavelen(int sample_id, Pcg32& stream) override
+  {
+    return wavelen[sample_id];
   }
 
-  float get_wavelen(int sample_id) override { return wavelen[sample_id]; }
+  vec2 get_film(int sample_id, Pcg32& stream) override
+  {
+    return film[sample_id];
+  }
 
-  vec2 get_lens(int sample_id) override { return lens[sample_id]; }
+  vec2 get_lens(int sample_id, Pcg32& stream) override
+  {
+    return lens[sample_id];
+  }
 
-  vec2 get_shading(int sample_id, int counter) override
+  vec2 get_shading(int sample_id, int counter, Pcg32& stream) override
   {
     if (counter < 4) {
       return shading[counter * n + sample_id];
     }
-    return vec2{frand(), frand()};
+    return vec2{stream.uniform(), stream.uniform()};
+  }
+
+  vec3 get_light(int sample_id, int counter, Pcg32& stream) override
+  {
+    if (counter < 4) {
+      return light[counter * n + sample_id];
+    }
+    return vec3{stream.uniform(), stream.uniform(), stream.uniform()};
+  }
+};
+
+// Hash based Owen scrambling, following Burley: "Practical Hash-based Owen
+// Scrambling", JCGT 2020.
+
+static uint32_t reverse_bits(uint32_t x)
+{
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+/// Flips each bit depending only on the bits below it.
+static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+/// Owen scrambling of a 32 bit fixed point number in [0, 1).
+static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+  return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+static uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+  return seed ^ (v + (seed << 6) + (seed >> 2));
+}
+
+static uint32_t hash(uint32_t x)
+{
+  // Integer finalizer from MurmurHash3.
+  x ^= x >> 16;
+  x *= 0x85ebca6bu;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35u;
+  x ^= x >> 16;
+  return x;
+}
+
+/// First two dimensions of the Sobol sequence, which together form (0,m,2)
+/// nets for every power of two prefix.
+static uint32_t sobol0(uint32_t index) { return reverse_bits(index); }
+
+static uint32_t sobol1(uint32_t index)
+{
+  uint32_t result = 0;
+  for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+    if (index & 1) result ^= v;
+  }
+  return result;
+}
+
+static float to_unit_float(uint32_t x) { return (x >> 8) * (1.0f / (1 << 24)); }
+
+/// Scrambled Sobol points with any number of dimensions. Every dimension
+/// (or pair of dimensions) is a 1D (or 2D) Sobol sequence with its own
+/// Owen scrambling and its own shuffled sample order, seeded per pixel, so
+/// that dimensions don't correlate with each other.
+struct SobolSampler : public Sampler {
+  uint32_t pixel_seed = 0;
+
+  SobolSampler(int n) : Sampler(n) {}
+
+  void generate_samples() override { pixel_seed = hash(pixel); }
+
+  float get_wavelen(int sample_id, Pcg32& stream) override
+  {
+    return Spectrum::wavelen(get_1d(sample_id, 0));
+  }
+
+  vec2 get_film(int sample_id, Pcg32& stream) override
+  {
+    return get_2d(sample_id, 1);
+  }
+
+  vec2 get_lens(int sample_id, Pcg32& stream) override
+  {
+    return get_2d(sample_id, 2);
+  }
+
+  vec2 get_shading(int sample_id, int counter, Pcg32& stream) override
+  {
+    return get_2d(sample_id, 3 + 3 * counter);
+  }
+
+  vec3 get_light(int sample_id, int counter, Pcg32& stream) override
+  {
+    vec2 uv = get_2d(sample_id, 4 + 3 * counter);
+    return vec3{get_1d(sample_id, 5 + 3 * counter), uv.x, uv.y};
+  }
+
+private:
+  uint32_t seed(int dimension, uint32_t k) const
+  {
+    return hash(hash_combine(hash_combine(pixel_seed, dimension), k));
+  }
+
+  uint32_t shuffled_index(int sample_id, int dimension) const
+  {
+    return nested_uniform_scramble(sample_id, seed(dimension, 0));
+  }
+
+  float get_1d(int sample_id, int dimension) const
+  {
+    uint32_t i = shuffled_index(sample_id, dimension);
+    return to_unit_float(nested_uniform_scramble(sobol0(i), seed(dimension, 1)));
+  }
+
+  vec2 get_2d(int sample_id, int dimension) const
+  {
+    uint32_t i = shuffled_index(sample_id, dimension);
+    return vec2{
+        to_unit_float(nested_uniform_scramble(sobol0(i), seed(dimension, 1))),
+        to_unit_float(nested_uniform_scramble(sobol1(i), seed(dimension, 2)))};
   }
 };
 
@@ -98,6 +297,8 @@ std::shared_ptr<Sampler> create_sampler(int n, const std::string& name)
     return std::make_shared<LibCRandomSampler>(n);
   else if (name == "lhs")
     return std::make_shared<LhsSampler>(n);
+  else if (name == "sobol")
+    return std::make_shared<SobolSampler>(n);
   else
     throw std::runtime_error("unknown sampler '" + name + "'");
 }
@@ -1,6 +1,8 @@
 #pragma once
 #include "pupumath_struct.hpp"
 #include "util.hpp"
+#include <algorithm>
+#include <cstddef>
 #include <memory>
 
 struct Sampler;
@@ -9,36 +11,90 @@ struct Sample {
   Sampler* sampler;
   int id;
   int shading_counter;
+  int light_counter;
+  /// Numbers for decisions that don't need to be stratified, like Russian
+  /// roulette. Seeded from the pixel and sample index.
+  Pcg32 rng;
+  /// Numbers the sampler draws on demand for this sample, so that they don't
+  /// depend on other samples drawn before or in between.
+  Pcg32 stream;
 
-  Sample(Sampler* sampler, int id)
-      : sampler(sampler), id(id), shading_counter(0)
-  {
-  }
+  Sample(Sampler* sampler, int id);
 
-  float wavelen() const;
-  pupumath::vec2 lens() const;
+  float wavelen();
+  /// Position within the pixel.
+  pupumath::vec2 film();
+  pupumath::vec2 lens();
   pupumath::vec2 shading();
+  /// Three numbers for picking a light and a point on it.
+  pupumath::vec3 light();
 };
 
+/// Samples of a pixel only depend on the pixel and sample index, for every
+/// sampler, so a sample is the same whichever pass renders it.
 struct Sampler {
   int n;
+  /// Index of the current pixel.
+  uint32_t pixel;
+  /// For generate_samples(), reseeded for every pixel.
+  Pcg32 rng;
 
-  Sampler(int n) : n(n) {}
+  Sampler(int n) : n(n), pixel(0) {}
   virtual ~Sampler() {}
 
-  /// Generate samples for one pixel.
-  virtual void generate() = 0;
+  /// Generate samples for one pixel. They only depend on the pixel index.
+  /// lhs builds tables for all `n` samples here, however few get used, so
+  /// rendering a pixel in several passes builds them once per pass.
+  void generate(uint32_t pixel)
+  {
+    this->pixel = pixel;
+    rng.set_seed(pixel, 0);
+    generate_samples();
+  }
 
-  virtual float get_wavelen(int sample_id) = 0;
-  virtual pupumath::vec2 get_lens(int sample_id) = 0;
-  virtual pupumath::vec2 get_shading(int sample_id, int counter) = 0;
+  /// Bytes of state kept for the current pixel, for bounding how many
+  /// samplers are kept at once.
+  virtual size_t state_size() const { return sizeof(*this); }
+
+protected:
+  virtual void generate_samples() {}
+
+public:
+  // Numbers that aren't precomputed are drawn from `stream`, the sample's
+  // own generator.
+  virtual float get_wavelen(int sample_id, Pcg32& stream) = 0;
+  virtual pupumath::vec2 get_film(int sample_id, Pcg32& stream) = 0;
+  virtual pupumath::vec2 get_lens(int sample_id, Pcg32& stream) = 0;
+  virtual pupumath::vec2 get_shading(int sample_id, int counter,
+                                     Pcg32& stream) = 0;
+  virtual pupumath::vec3 get_light(int sample_id, int counter,
+                                   Pcg32& stream) = 0;
 };
 
-inline float Sample::wavelen() const { return sampler->get_wavelen(id); }
-inline pupumath::vec2 Sample::lens() const { return sampler->get_lens(id); }
+inline Sample::Sample(Sampler* sampler, int id)
+    : sampler(sampler), id(id), shading_counter(0), light_counter(0),
+      rng(sampler->pixel, id + 1),
+      // Same sequence as `rng`, but far away from it.
+      stream(sampler->pixel | uint64_t(1) << 32, id + 1)
+{
+}
+
+inline float Sample::wavelen() { return sampler->get_wavelen(id, stream); }
+inline pupumath::vec2 Sample::film()
+{
+  // (i + u) / n can round up to 1, which would put the sample in the next
+  // pixel and reach past the filter's margin.
+  pupumath::vec2 p = sampler->get_film(id, stream);
+  return {std::min(p.x, 0.99999994f), std::min(p.y, 0.99999994f)};
+}
+inline pupumath::vec2 Sample::lens() { return sampler->get_lens(id, stream); }
 inline pupumath::vec2 Sample::shading()
 {
-  return sampler->get_shading(id, shading_counter++);
+  return sampler->get_shading(id, shading_counter++, stream);
+}
+inline pupumath::vec3 Sample::light()
+{
+  return sampler->get_light(id, light_counter++, stream);
 }
 
 std::shared_ptr<Sampler> create_sampler(int n, const std::string& name);
@@ -0,0 +1,82 @@
+#include "scene.hpp"
+#include "material.hpp"
+#include "shape.hpp"
+using namespace pupumath;
+
+void Scene::build_bvh()
+{
+  std::vector<Bounds> bounds;
+  std::vector<int> bounded;
+  unbounded.clear();
+  for (size_t i = 0; i < objects.size(); i++) {
+    const auto& o = objects[i];
+    Bounds b = transform_bounds(o.xform, o.shape->bounds());
+    if (is_finite(b)) {
+      bounds.push_back(b);
+      bounded.push_back(i);
+    }
+    else {
+      unbounded.push_back(i);
+    }
+  }
+
+  bvh = Bvh(bounds);
+  // Map leaf entries back to indices into `objects`.
+  std::vector<int> indices = bvh.indices.to_vector();
+  for (auto& index : indices) {
+    index = bounded[index];
+  }
+  bvh = Bvh(bvh.nodes, std::move(indices));
+}
+
+/// Factor by which the transformation scales surface area around a point
+/// with (unit) object space normal `n`.
+static float area_scale(const Transform& xform, const vec3& n)
+{
+  return fabs(determinant(xform.M)) * norm(transform_normal(xform, n));
+}
+
+void Scene::build_lights()
+{
+  lights.clear();
+  light_index.assign(objects.size(), -1);
+  std::vector<float> power;
+  for (const auto& o : objects) {
+    float area = o.shape->area();
+    if (area <= 0) continue;
+
+    float emittance = sum(o.mat->emittance);
+    if (emittance <= 0) continue;
+
+    // Approximate the world space area from the mean scale factor.
+    float world_area = area * powf(fabs(determinant(o.xform.M)), 2.0f / 3);
+    light_index[&o - objects.data()] = lights.size();
+    lights.push_back(&o);
+    power.push_back(world_area * emittance);
+  }
+  light_distribution = Distribution1D(power);
+}
+
+LightSample Scene::sample_light(float u0, float u1, float u2) const
+{
+  float select_pdf;
+  const GeometricObject* o = lights[light_distribution.sample(u0, select_pdf)];
+
+  vec3 p, n;
+  o->shape->sample(u1, u2, p, n);
+
+  // Points are uniform in object space; convert the density to world space.
+  float pdf = select_pdf / (o->shape->area() * area_scale(o->xform, n));
+  return {o, transform_point(o->xform, p),
+          normalize(transform_normal(o->xform, n)), pdf};
+}
+
+float Scene::light_pdf(const GeometricObject* object, const vec3& normal) const
+{
+  int index = light_index[object - objects.data()];
+  if (index < 0) return 0.0f;
+
+  vec3 n = normalize(inverse_transform_normal(object->xform, normal));
+  return light_distribution.pdf(index) /
+         (object->shape->area() * area_scale(object->xform, n));
+}
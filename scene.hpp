@@ -1,5 +1,7 @@
 #pragma once
+#include "bvh.hpp"
 #include "pupumath_struct.hpp"
+#include "util.hpp"
 #include <memory>
 #include <vector>
 
@@ -20,8 +22,42 @@ public:
   pupumath::Transform xform;
 };
 
+/// Point picked on an emissive object, in world space.
+struct LightSample {
+  const GeometricObject* object;
+  pupumath::vec3 position;
+  pupumath::vec3 normal;
+  /// Probability density per unit world space area, including the
+  /// probability of having picked this light.
+  float pdf;
+};
+
 struct Scene {
   std::vector<GeometricObject> objects;
   std::shared_ptr<Skybox> skybox;
   std::shared_ptr<Camera> camera;
+
+  /// World space hierarchy over the bounded objects.
+  Bvh bvh;
+  /// Objects with infinite bounds, which are tested separately.
+  std::vector<int> unbounded;
+
+  /// Objects with a nonzero emittance that can be sampled.
+  std::vector<const GeometricObject*> lights;
+  /// Picks lights proportional to their approximate emitted power.
+  Distribution1D light_distribution;
+  /// Index into `lights` for each object, or -1.
+  std::vector<int> light_index;
+
+  /// Build the acceleration structures. Call after all objects are added.
+  void build_bvh();
+  /// Collect the light list. Call after all objects are added.
+  void build_lights();
+
+  /// Pick a point on one of the lights using three uniform numbers.
+  LightSample sample_light(float u0, float u1, float u2) const;
+  /// Density per unit world space area with which `sample_light` returns a
+  /// point on `object` that has the world space normal `normal`.
+  float light_pdf(const GeometricObject* object,
+                  const pupumath::vec3& normal) const;
 };
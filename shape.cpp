@@ -1,13 +1,78 @@
 #include "shape.hpp"
+#include "bvh.hpp"
+#include "bvh_cache.hpp"
 #include "debug.hpp"
+#include "packet.hpp"
+#include "ply.hpp"
 #include "pupumath.hpp"
 #include "ray.hpp"
+#include "shared_array.hpp"
+#include "util.hpp"
 #include "ValueBlock.hpp"
+#include <cstring>
+#include <stdexcept>
+#include <string>
 #include <vector>
 using namespace pupumath;
 
+mask4 Shape::intersect4(RayPacket& ray, mask4 active, mask4 is_originator,
+                        mask4 inside_originator) const
+{
+  int hits = 0;
+  for (int i = 0; i < 4; i++) {
+    if (!active[i]) continue;
+    Ray r;
+    r.origin = ray.origin.lane(i);
+    r.direction = ray.direction.lane(i);
+    r.tmax = ray.tmax[i];
+    if (intersect(r, is_originator[i], inside_originator[i])) {
+      ray.tmax[i] = r.tmax;
+      ray.position.set_lane(i, r.position);
+      ray.normal.set_lane(i, r.normal);
+      hits |= 1 << i;
+    }
+  }
+  return mask4::from_bits(hits);
+}
+
+/// Sphere::intersect() and ScaledSphere::intersect() for four rays.
+static mask4 intersect_sphere4(RayPacket& ray, float radius2, mask4 active,
+                               mask4 is_originator, mask4 inside_originator)
+{
+  float4 a = dot(ray.direction, ray.direction);
+  float4 b = dot(ray.origin, ray.direction) * 2.0f;
+  float4 c = dot(ray.origin, ray.origin) - float4(radius2);
+  float4 d = b * b - a * 4.0f * c;
+
+  float4 sqrt_d = sqrt(d);
+  float4 t1 = (b + sqrt_d) / (a * -2.0f);
+  float4 t2 = (b - sqrt_d) / (a * -2.0f);
+  float4 t = select(is_originator, select(inside_originator, t2, t1),
+                    select(t1 < float4(0.0f), t2, t1));
+
+  mask4 hit = active & ~(d < float4(0.0f)) & ~(t < float4(0.0f)) &
+              ~(t > ray.tmax);
+  if (!hit.any()) return hit;
+
+  ray.tmax = select(hit, t, ray.tmax);
+  vec3x4 position = ray.origin + ray.direction * t;
+  ray.position = select(hit, position, ray.position);
+  ray.normal = select(hit, normalize(position), ray.normal);
+  return hit;
+}
+
 class Sphere : public Shape {
 public:
+  Bounds bounds() const { return Bounds(vec3(-1), vec3(1)); }
+
+  float area() const { return 4 * M_PI; }
+
+  void sample(float u1, float u2, vec3& position, vec3& normal) const
+  {
+    position = sample_sphere(u1, u2);
+    normal = position;
+  }
+
   bool intersect(Ray& ray, bool is_originator, bool inside_originator) const
   {
     float a = dot(ray.direction, ray.direction);
@@ -44,6 +109,13 @@ public:
 
     return true;
   }
+
+  mask4 intersect4(RayPacket& ray, mask4 active, mask4 is_originator,
+                   mask4 inside_originator) const
+  {
+    return intersect_sphere4(ray, 1.0f, active, is_originator,
+                             inside_originator);
+  }
 };
 
 class ScaledSphere : public Shape {
@@ -52,6 +124,16 @@ public:
 
   float radius;
 
+  Bounds bounds() const { return Bounds(vec3(-radius), vec3(radius)); }
+
+  float area() const { return 4 * M_PI * radius * radius; }
+
+  void sample(float u1, float u2, vec3& position, vec3& normal) const
+  {
+    normal = sample_sphere(u1, u2);
+    position = normal * radius;
+  }
+
   bool intersect(Ray& ray, bool is_originator, bool inside_originator) const
   {
     float a = dot(ray.direction, ray.direction);
@@ -88,10 +170,28 @@ public:
 
     return true;
   }
+
+  mask4 intersect4(RayPacket& ray, mask4 active, mask4 is_originator,
+                   mask4 inside_originator) const
+  {
+    return intersect_sphere4(ray, radius * radius, active, is_originator,
+                             inside_originator);
+  }
 };
 
 class Plane : public Shape {
 public:
+  Bounds bounds() const { return Bounds::infinite(); }
+
+  // Infinite, so it can't act as an area light.
+  float area() const { return 0; }
+
+  void sample(float u1, float u2, vec3& position, vec3& normal) const
+  {
+    position = vec3(0);
+    normal = vec3(0, 1, 0);
+  }
+
   bool intersect(Ray& ray, bool is_originator, bool inside_originator) const
   {
     if (ray.direction.y == 0) return false;
@@ -112,94 +212,457 @@ public:
 
     return true;
   }
+
+  mask4 intersect4(RayPacket& ray, mask4 active, mask4 is_originator,
+                   mask4 inside_originator) const
+  {
+    const float4 zero(0.0f);
+    float4 dy = ray.direction.y;
+    mask4 miss = (dy == zero) |
+                 (is_originator & ((inside_originator & (dy < zero)) |
+                                   (~inside_originator & (dy > zero))));
+
+    float4 t = -ray.origin.y / dy;
+
+    mask4 hit = active & ~miss & ~(t < zero) & ~(t > ray.tmax);
+    if (!hit.any()) return hit;
+
+    ray.tmax = select(hit, t, ray.tmax);
+    ray.position =
+        select(hit, ray.origin + ray.direction * t, ray.position);
+    ray.normal = select(hit, vec3x4(vec3(0, 1, 0)), ray.normal);
+    return hit;
+  }
 };
 
+/// An Efficient Ray-Quadrilateral Intersection Test
+/// Area Lagae, Philip Dutré
+///
+/// On a hit returns the ray parameter in `t` and the unnormalized geometric
+/// normal in `n`.
+static bool intersect_quad(const Ray& ray, const vec3& v0, const vec3& v1,
+                           const vec3& v2, const vec3& v3, float& t, vec3& n)
+{
+  // Reject rays using the barycentric coordinates of
+  // the intersection point with respect to T.
+  vec3 e01 = v1 - v0;
+  vec3 e03 = v3 - v0;
+  vec3 p = cross(ray.direction, e03);
+  float det = dot(e01, p);
+  if (fabs(det) == 0) return false;
+
+  vec3 T = ray.origin - v0;
+  float a = dot(T, p) / det;
+  if (a < 0 || a > 1) return false;
+
+  vec3 q = cross(T, e01);
+  float b = dot(ray.direction, q) / det;
+  if (b < 0 || b > 1) return false;
+
+  // Reject rays using the barycentric coordinates of
+  // the intersection point with respect to T'.
+  if ((a + b) > 1) {
+    vec3 e23 = v3 - v2;
+    vec3 e21 = v1 - v2;
+    vec3 p = cross(ray.direction, e21);
+    float det = dot(e23, p);
+    if (fabs(det) == 0) return false;
+
+    vec3 T = ray.origin - v2;
+    float a = dot(T, p) / det;
+    if (a < 0 || a > 1) return false;
+
+    vec3 q = cross(T, e23);
+    float b = dot(ray.direction, q) / det;
+    if (b < 0 || b > 1) return false;
+  }
+
+  // Compute the ray parameter of the intersection point.
+  t = dot(e03, q) / det;
+  n = cross(e01, e03);
+  return true;
+}
+
+/// intersect_quad() for four rays against one quad. Returns the lanes that
+/// hit; the normal is the same for all of them.
+static mask4 intersect_quad4(const RayPacket& ray, const vec3& v0,
+                             const vec3& v1, const vec3& v2, const vec3& v3,
+                             float4& t, vec3& n)
+{
+  const float4 zero(0.0f), one(1.0f);
+  vec3 e01 = v1 - v0;
+  vec3 e03 = v3 - v0;
+  vec3x4 p = cross(ray.direction, vec3x4(e03));
+  float4 det = dot(vec3x4(e01), p);
+  mask4 miss = det == zero;
+
+  vec3x4 T = ray.origin - vec3x4(v0);
+  float4 a = dot(T, p) / det;
+  miss = miss | (a < zero) | (a > one);
+
+  vec3x4 q = cross(T, vec3x4(e01));
+  float4 b = dot(ray.direction, q) / det;
+  miss = miss | (b < zero) | (b > one);
+
+  mask4 second = ~miss & (a + b > one);
+  if (second.any()) {
+    vec3 e23 = v3 - v2;
+    vec3 e21 = v1 - v2;
+    vec3x4 p = cross(ray.direction, vec3x4(e21));
+    float4 det = dot(vec3x4(e23), p);
+
+    vec3x4 T = ray.origin - vec3x4(v2);
+    float4 a = dot(T, p) / det;
+
+    vec3x4 q = cross(T, vec3x4(e23));
+    float4 b = dot(ray.direction, q) / det;
+    miss = miss | (second & ((det == zero) | (a < zero) | (a > one) |
+                             (b < zero) | (b > one)));
+  }
+
+  t = dot(vec3x4(e03), q) / det;
+  n = cross(e01, e03);
+  return ~miss;
+}
+
+/// Meshes may come from files, so check the faces before using them.
+static void check_faces(const SharedArray<vec3>& vertices,
+                        const SharedArray<int>& faces, int corners)
+{
+  if (faces.size() % corners != 0) {
+    throw std::runtime_error("mesh face list is not a multiple of " +
+                             std::to_string(corners));
+  }
+  for (int i : faces) {
+    if (i < 0 || size_t(i) >= vertices.size()) {
+      throw std::runtime_error("mesh vertex index " + std::to_string(i) +
+                               " out of range");
+    }
+  }
+}
+
+/// Content key of a mesh hierarchy. Changing the geometry changes the key.
+static uint64_t mesh_key(const char* kind, const SharedArray<vec3>& vertices,
+                         const SharedArray<int>& faces)
+{
+  uint64_t h = hash_bytes(kind, strlen(kind));
+  h = hash_bytes(vertices.data(), vertices.size() * sizeof(vec3), h);
+  return hash_bytes(faces.data(), faces.size() * sizeof(int), h);
+}
+
+/// Build the hierarchy over the given primitives, or get it from `cache`.
+template <typename F>
+static Bvh build_mesh_bvh(BvhCache* cache, uint64_t key, size_t count,
+                          F&& primitive_bounds)
+{
+  const int max_leaf_size = 4;
+  auto build = [&]() {
+    std::vector<Bounds> bounds(count);
+    for (size_t i = 0; i < count; ++i) {
+      bounds[i] = primitive_bounds(i);
+    }
+    return Bvh(bounds, max_leaf_size);
+  };
+  // Small hierarchies build faster than a file can be opened.
+  const size_t min_cached_count = 4096;
+  if (cache && count >= min_cached_count) {
+    // Other builder settings give another hierarchy for the same mesh.
+    Bvh::BuildParameters params = Bvh::build_parameters(max_leaf_size);
+    key = hash_bytes(&params, sizeof(params), key);
+    return cache->get(key, count, build);
+  }
+  return build();
+}
+
 class QuadMesh : public Shape {
 public:
-  QuadMesh(std::vector<vec3> v, std::vector<int> f) : vertdata(v), facedata(f)
+  QuadMesh(SharedArray<vec3> v, SharedArray<int> f, BvhCache* cache)
+      : vertdata(std::move(v)), facedata(std::move(f))
   {
+    check_faces(vertdata, facedata, 4);
+    size_t count = facedata.size() / 4;
+    bvh = build_mesh_bvh(cache, mesh_key("quadmesh", vertdata, facedata),
+                         count, [&](size_t i) {
+                           Bounds b;
+                           for (int k = 0; k < 4; ++k) {
+                             b = merge(b, vertdata[facedata[i * 4 + k]]);
+                           }
+                           return b;
+                         });
+
+    // Quads are sampled as the two triangles the intersection test uses.
+    std::vector<float> areas;
+    for (size_t i = 0; i < count; ++i) {
+      vec3 v0, v1, v2, v3;
+      get_quad(i, v0, v1, v2, v3);
+      areas.push_back(norm(cross(v1 - v0, v3 - v0)) / 2);
+      areas.push_back(norm(cross(v3 - v2, v1 - v2)) / 2);
+    }
+    area_distribution = Distribution1D(areas);
   }
 
-  std::vector<vec3> vertdata;
-  std::vector<int> facedata;
+  SharedArray<vec3> vertdata;
+  SharedArray<int> facedata;
+  Bvh bvh;
+  Distribution1D area_distribution;
 
-  bool intersect(Ray& ray, bool is_originator, bool inside_originator) const
+  void get_quad(int i, vec3& v0, vec3& v1, vec3& v2, vec3& v3) const
   {
-    // An Efficient Ray-Quadrilateral Intersection Test
-    // Area Lagae, Philip Dutré
+    v0 = vertdata[facedata[i * 4 + 0]];
+    v1 = vertdata[facedata[i * 4 + 1]];
+    v2 = vertdata[facedata[i * 4 + 2]];
+    v3 = vertdata[facedata[i * 4 + 3]];
+  }
+
+  float area() const { return area_distribution.total(); }
 
-    float tmax = ray.tmax;
-    bool hit = false;
+  void sample(float u1, float u2, vec3& position, vec3& normal) const
+  {
+    float pdf;
+    int t = area_distribution.sample(u1, pdf);
+    vec3 v0, v1, v2, v3;
+    get_quad(t / 2, v0, v1, v2, v3);
+    if (t % 2 == 0) {
+      position = sample_triangle(u1, u2, v0, v1, v3);
+    }
+    else {
+      position = sample_triangle(u1, u2, v2, v3, v1);
+    }
+    normal = normalize(cross(v1 - v0, v3 - v0));
+  }
+
+  Bounds bounds() const
+  {
+    Bounds b;
+    for (int i : facedata) {
+      b = merge(b, vertdata[i]);
+    }
+    return b;
+  }
+
+  bool intersect(Ray& ray, bool is_originator, bool inside_originator) const
+  {
     vec3 n;
 
-    for (size_t i = 0; i < facedata.size() / 4; ++i) {
-      vec3 v0 = vertdata[facedata[i * 4 + 0]];
-      vec3 v1 = vertdata[facedata[i * 4 + 1]];
-      vec3 v2 = vertdata[facedata[i * 4 + 2]];
-      vec3 v3 = vertdata[facedata[i * 4 + 3]];
-
-      // Reject rays using the barycentric coordinates of
-      // the intersection point with respect to T.
-      vec3 e01 = v1 - v0;
-      vec3 e03 = v3 - v0;
-      vec3 p = cross(ray.direction, e03);
-      float det = dot(e01, p);
-      if (fabs(det) == 0) continue;
-
-      vec3 T = ray.origin - v0;
-      float a = dot(T, p) / det;
-      if (a < 0 || a > 1) continue;
-
-      vec3 q = cross(T, e01);
-      float b = dot(ray.direction, q) / det;
-      if (b < 0 || b > 1) continue;
-
-      // Reject rays using the barycentric coordinates of
-      // the intersection point with respect to T'.
-      if ((a + b) > 1) {
-        vec3 e23 = v3 - v2;
-        vec3 e21 = v1 - v2;
-        vec3 p = cross(ray.direction, e21);
-        float det = dot(e23, p);
-        if (fabs(det) == 0) continue;
-
-        vec3 T = ray.origin - v2;
-        float a = dot(T, p) / det;
-        if (a < 0 || a > 1) continue;
-
-        vec3 q = cross(T, e23);
-        float b = dot(ray.direction, q) / det;
-        if (b < 0 || b > 1) continue;
+    bool hit = bvh.traverse(ray, [&](int i) {
+      float t;
+      vec3 qn;
+      if (!intersect_quad(ray, vertdata[facedata[i * 4 + 0]],
+                          vertdata[facedata[i * 4 + 1]],
+                          vertdata[facedata[i * 4 + 2]],
+                          vertdata[facedata[i * 4 + 3]], t, qn)) {
+        return false;
+      }
+      if (t < 0.0f) return false;
+      if (t > ray.tmax) return false;
+
+      if (is_originator) {
+        bool inbound = (dot(ray.direction, qn) < 0);
+        if (inside_originator && inbound) return false;
+        if (!inside_originator && !inbound) return false;
       }
 
-      // Compute the ray parameter of the intersection point.
-      float t = dot(e03, q) / det;
-      if (t < 0.0f) continue;
-      if (t > tmax) continue;
+      ray.tmax = t;
+      n = qn;
+      return true;
+    });
+
+    if (!hit) return false;
+
+    ray.position = ray.origin + ray.direction * ray.tmax;
+    ray.normal = normalize(n);
+
+    return true;
+  }
+
+  mask4 intersect4(RayPacket& ray, mask4 active, mask4 is_originator,
+                   mask4 inside_originator) const
+  {
+    vec3x4 n(vec3(0.0f));
+
+    mask4 hit = bvh.traverse4(ray, active, [&](int i, mask4 lanes) {
+      float4 t;
+      vec3 qn;
+      mask4 m = intersect_quad4(ray, vertdata[facedata[i * 4 + 0]],
+                                vertdata[facedata[i * 4 + 1]],
+                                vertdata[facedata[i * 4 + 2]],
+                                vertdata[facedata[i * 4 + 3]], t, qn);
+      m = m & lanes & ~(t < float4(0.0f)) & ~(t > ray.tmax);
+
+      mask4 inbound = dot(ray.direction, vec3x4(qn)) < float4(0.0f);
+      m = m & ~(is_originator & ((inside_originator & inbound) |
+                                 (~inside_originator & ~inbound)));
+
+      ray.tmax = select(m, t, ray.tmax);
+      n = select(m, vec3x4(qn), n);
+      return m;
+    });
+
+    if (!hit.any()) return hit;
+
+    ray.position =
+        select(hit, ray.origin + ray.direction * ray.tmax, ray.position);
+    ray.normal = select(hit, normalize(n), ray.normal);
+    return hit;
+  }
+};
+
+/// Per-ray setup for the watertight ray/triangle test of
+/// Woop, Benthin, Wald: Watertight Ray/Triangle Intersection (JCGT 2013).
+struct WatertightRay {
+  int kx, ky, kz;
+  float Sx, Sy, Sz;
+
+  WatertightRay(const vec3& dir)
+  {
+    float ax = fabs(dir.x);
+    float ay = fabs(dir.y);
+    float az = fabs(dir.z);
+    kz = (ax > ay) ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    // Preserve the winding of the triangle.
+    if (dir[kz] < 0) std::swap(kx, ky);
+    Sx = dir[kx] / dir[kz];
+    Sy = dir[ky] / dir[kz];
+    Sz = 1.0f / dir[kz];
+  }
+};
+
+/// On a hit returns the ray parameter in `t`, which may be negative.
+static bool intersect_triangle(const Ray& ray, const WatertightRay& w,
+                               const vec3& v0, const vec3& v1, const vec3& v2,
+                               float& t)
+{
+  const vec3 A = v0 - ray.origin;
+  const vec3 B = v1 - ray.origin;
+  const vec3 C = v2 - ray.origin;
+
+  // Shear and scale the vertices so that the ray points along +z.
+  const float Ax = A[w.kx] - w.Sx * A[w.kz];
+  const float Ay = A[w.ky] - w.Sy * A[w.kz];
+  const float Bx = B[w.kx] - w.Sx * B[w.kz];
+  const float By = B[w.ky] - w.Sy * B[w.kz];
+  const float Cx = C[w.kx] - w.Sx * C[w.kz];
+  const float Cy = C[w.ky] - w.Sy * C[w.kz];
+
+  // Scaled barycentric coordinates. Fall back to double precision on edges
+  // so that rays can't slip between neighbouring triangles.
+  float U = Cx * By - Cy * Bx;
+  float V = Ax * Cy - Ay * Cx;
+  float W = Bx * Ay - By * Ax;
+  if (U == 0.0f || V == 0.0f || W == 0.0f) {
+    U = float(double(Cx) * double(By) - double(Cy) * double(Bx));
+    V = float(double(Ax) * double(Cy) - double(Ay) * double(Cx));
+    W = float(double(Bx) * double(Ay) - double(By) * double(Ax));
+  }
+
+  if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) return false;
+
+  float det = U + V + W;
+  if (det == 0.0f) return false;
+
+  const float Az = w.Sz * A[w.kz];
+  const float Bz = w.Sz * B[w.kz];
+  const float Cz = w.Sz * C[w.kz];
+  t = (U * Az + V * Bz + W * Cz) / det;
+  return true;
+}
+
+class TriangleMesh : public Shape {
+public:
+  TriangleMesh(SharedArray<vec3> v, SharedArray<int> f, BvhCache* cache)
+      : vertdata(std::move(v)), facedata(std::move(f))
+  {
+    check_faces(vertdata, facedata, 3);
+    size_t count = facedata.size() / 3;
+    bvh = build_mesh_bvh(cache, mesh_key("trianglemesh", vertdata, facedata),
+                         count, [&](size_t i) {
+                           Bounds b;
+                           for (int k = 0; k < 3; ++k) {
+                             b = merge(b, vertdata[facedata[i * 3 + k]]);
+                           }
+                           return b;
+                         });
+
+    std::vector<float> areas(count);
+    for (size_t i = 0; i < areas.size(); ++i) {
+      areas[i] = norm(geometric_normal(i)) / 2;
+    }
+    area_distribution = Distribution1D(areas);
+  }
+
+  SharedArray<vec3> vertdata;
+  SharedArray<int> facedata;
+  Bvh bvh;
+  Distribution1D area_distribution;
+
+  vec3 vertex(int triangle, int k) const
+  {
+    return vertdata[facedata[triangle * 3 + k]];
+  }
+
+  /// Unnormalized normal, following the winding of the triangle.
+  vec3 geometric_normal(int i) const
+  {
+    return cross(vertex(i, 1) - vertex(i, 0), vertex(i, 2) - vertex(i, 0));
+  }
 
-      n = cross(e01, e03);
+  float area() const { return area_distribution.total(); }
 
+  void sample(float u1, float u2, vec3& position, vec3& normal) const
+  {
+    float pdf;
+    int i = area_distribution.sample(u1, pdf);
+    position = sample_triangle(u1, u2, vertex(i, 0), vertex(i, 1), vertex(i, 2));
+    normal = normalize(geometric_normal(i));
+  }
+
+  Bounds bounds() const
+  {
+    Bounds b;
+    for (int i : facedata) {
+      b = merge(b, vertdata[i]);
+    }
+    return b;
+  }
+
+  bool intersect(Ray& ray, bool is_originator, bool inside_originator) const
+  {
+    const WatertightRay w(ray.direction);
+    vec3 n;
+
+    bool hit = bvh.traverse(ray, [&](int i) {
+      const vec3& v0 = vertdata[facedata[i * 3 + 0]];
+      const vec3& v1 = vertdata[facedata[i * 3 + 1]];
+      const vec3& v2 = vertdata[facedata[i * 3 + 2]];
+      float t;
+      if (!intersect_triangle(ray, w, v0, v1, v2, t)) return false;
+      if (t < 0.0f) return false;
+      if (t > ray.tmax) return false;
+
+      vec3 tn = cross(v1 - v0, v2 - v0);
       if (is_originator) {
-        bool inbound = (dot(ray.direction, n) < 0);
-        if (inside_originator && inbound) continue;
-        if (!inside_originator && !inbound) continue;
+        bool inbound = (dot(ray.direction, tn) < 0);
+        if (inside_originator && inbound) return false;
+        if (!inside_originator && !inbound) return false;
       }
 
-      tmax = t;
-      hit = true;
-    }
+      ray.tmax = t;
+      n = tn;
+      return true;
+    });
 
     if (!hit) return false;
 
-    ray.tmax = tmax;
-    ray.position = ray.origin + ray.direction * tmax;
+    ray.position = ray.origin + ray.direction * ray.tmax;
     ray.normal = normalize(n);
 
     return true;
   }
 };
 
-std::shared_ptr<Shape> build_shape(const ValueBlock& block)
+std::shared_ptr<Shape> build_shape(const ValueBlock& block, BvhCache* cache)
 {
   auto type = block.get<std::string>("type");
   if (type == "sphere") {
@@ -209,8 +672,19 @@ std::shared_ptr<Shape> build_shape(const ValueBlock& block)
     return std::make_shared<Plane>();
   }
   else if (type == "quadmesh") {
-    return std::make_shared<QuadMesh>(block.get<std::vector<vec3>>("vertices"),
-                                      block.get<std::vector<int>>("faces"));
+    return std::make_shared<QuadMesh>(
+        block.get<SharedArray<vec3>>("vertices"),
+        block.get<SharedArray<int>>("faces"), cache);
+  }
+  else if (type == "trianglemesh") {
+    if (block.has<std::string>("file")) {
+      PlyMesh mesh = read_ply(percent_decode(block.get<std::string>("file")));
+      return std::make_shared<TriangleMesh>(std::move(mesh.vertices),
+                                            std::move(mesh.triangles), cache);
+    }
+    return std::make_shared<TriangleMesh>(
+        block.get<SharedArray<vec3>>("vertices"),
+        block.get<SharedArray<int>>("faces"), cache);
   }
   else {
     throw std::runtime_error("unknown shape");
@@ -1,14 +1,37 @@
 #pragma once
+#include "pupumath_struct.hpp"
 #include <memory>
 
 struct Ray;
+struct RayPacket;
 struct ValueBlock;
+struct mask4;
 
 class Shape {
 public:
   virtual bool intersect(Ray &ray, bool is_originator,
                          bool inside_originator) const = 0;
+
+  /// intersect() for the `active` lanes of a packet, returning the lanes
+  /// that hit. The default intersects one lane at a time.
+  virtual mask4 intersect4(RayPacket &ray, mask4 active, mask4 is_originator,
+                           mask4 inside_originator) const;
+
+  /// Object space bounding box. Infinite for unbounded shapes.
+  virtual pupumath::Bounds bounds() const = 0;
+
+  /// Object space surface area. Zero for shapes that can't be sampled.
+  virtual float area() const = 0;
+
+  /// Pick a point uniformly by area on the surface, in object space.
+  virtual void sample(float u1, float u2, pupumath::vec3 &position,
+                      pupumath::vec3 &normal) const = 0;
 };
 
-std::shared_ptr<Shape> build_shape (const ValueBlock&);
+class BvhCache;
+
+/// Build a shape. Mesh hierarchies are looked up in and added to `cache`,
+/// if given.
+std::shared_ptr<Shape> build_shape(const ValueBlock&,
+                                   BvhCache* cache = nullptr);
 
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/// Read-only view of an array that keeps its storage alive. The storage is
+/// either a vector the array took over or, for example, a memory mapped
+/// file the elements are used from in place. Copies share the storage.
+template <typename T>
+class SharedArray {
+public:
+  SharedArray() : ptr(nullptr), count(0) {}
+
+  SharedArray(std::vector<T> v)
+  {
+    auto storage = std::make_shared<std::vector<T>>(std::move(v));
+    ptr = storage->data();
+    count = storage->size();
+    owner = std::move(storage);
+  }
+
+  /// View `count` elements at `data`, which stay valid while `owner` lives.
+  SharedArray(const T* data, size_t count, std::shared_ptr<const void> owner)
+      : ptr(data), count(count), owner(std::move(owner))
+  {
+  }
+
+  const T* data() const { return ptr; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  const T* begin() const { return ptr; }
+  const T* end() const { return ptr + count; }
+  const T& operator[](size_t i) const { return ptr[i]; }
+
+  std::vector<T> to_vector() const { return std::vector<T>(begin(), end()); }
+
+private:
+  const T* ptr;
+  size_t count;
+  std::shared_ptr<const void> owner;
+};
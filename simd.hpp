@@ -0,0 +1,228 @@
+#pragma once
+// Four float lanes mapped onto an SSE register where available. The scalar
+// fallback has the same interface so that callers don't need to care.
+#include <cmath>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSE__
+#include <pmmintrin.h>
+#endif
+
+struct float4 {
+#ifdef __SSE__
+  union {
+    __m128 m;
+    float f[4];
+  };
+  float4() {}
+  float4(__m128 m) : m(m) {}
+  explicit float4(float c) : m(_mm_set1_ps(c)) {}
+  float4(float a, float b, float c, float d) : m(_mm_setr_ps(a, b, c, d)) {}
+  static float4 load(const float* p) { return _mm_loadu_ps(p); }
+  void store(float* p) const { _mm_storeu_ps(p, m); }
+#else
+  float f[4];
+  float4() {}
+  explicit float4(float c) : f{c, c, c, c} {}
+  float4(float a, float b, float c, float d) : f{a, b, c, d} {}
+  static float4 load(const float* p) { return {p[0], p[1], p[2], p[3]}; }
+  void store(float* p) const
+  {
+    for (int i = 0; i < 4; i++) p[i] = f[i];
+  }
+#endif
+
+  float& operator[](int i) { return f[i]; }
+  float operator[](int i) const { return f[i]; }
+};
+
+/// Per lane results of comparing float4s.
+struct mask4 {
+#ifdef __SSE__
+  /// All bits of a lane are set where the mask is true.
+  __m128 m;
+  mask4() {}
+  mask4(__m128 m) : m(m) {}
+  explicit mask4(bool b)
+      : m(b ? _mm_cmpeq_ps(_mm_setzero_ps(), _mm_setzero_ps())
+            : _mm_setzero_ps())
+  {
+  }
+  /// Lane i is true if bit i is set.
+  static mask4 from_bits(int bits)
+  {
+    return _mm_cmpneq_ps(
+        _mm_setr_ps(bits & 1, bits & 2, bits & 4, bits & 8), _mm_setzero_ps());
+  }
+  int bits() const { return _mm_movemask_ps(m); }
+#else
+  bool b[4];
+  mask4() {}
+  explicit mask4(bool c) : b{c, c, c, c} {}
+  static mask4 from_bits(int bits)
+  {
+    mask4 r;
+    for (int i = 0; i < 4; i++) r.b[i] = (bits >> i) & 1;
+    return r;
+  }
+  int bits() const { return b[0] | b[1] << 1 | b[2] << 2 | b[3] << 3; }
+#endif
+
+  bool any() const { return bits() != 0; }
+  bool operator[](int i) const { return (bits() >> i) & 1; }
+};
+
+#ifdef __SSE__
+
+inline float4 operator+(float4 a, float4 b) { return _mm_add_ps(a.m, b.m); }
+inline float4 operator-(float4 a, float4 b) { return _mm_sub_ps(a.m, b.m); }
+inline float4 operator*(float4 a, float4 b) { return _mm_mul_ps(a.m, b.m); }
+inline float4 operator/(float4 a, float4 b) { return _mm_div_ps(a.m, b.m); }
+inline float4 min(float4 a, float4 b) { return _mm_min_ps(a.m, b.m); }
+inline float4 max(float4 a, float4 b) { return _mm_max_ps(a.m, b.m); }
+inline float4 abs(float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.m); }
+inline float4 sqrt(float4 a) { return _mm_sqrt_ps(a.m); }
+inline float4 operator-(float4 a) { return _mm_xor_ps(a.m, _mm_set1_ps(-0.0f)); }
+
+// Comparisons are false for NaNs, except !=, like the scalar ones.
+inline mask4 operator<(float4 a, float4 b) { return _mm_cmplt_ps(a.m, b.m); }
+inline mask4 operator>(float4 a, float4 b) { return _mm_cmpgt_ps(a.m, b.m); }
+inline mask4 operator==(float4 a, float4 b) { return _mm_cmpeq_ps(a.m, b.m); }
+inline mask4 operator&(mask4 a, mask4 b) { return _mm_and_ps(a.m, b.m); }
+inline mask4 operator|(mask4 a, mask4 b) { return _mm_or_ps(a.m, b.m); }
+inline mask4 operator~(mask4 a) { return _mm_xor_ps(a.m, mask4(true).m); }
+
+/// `a` where the mask is true, `b` elsewhere.
+inline float4 select(mask4 mask, float4 a, float4 b)
+{
+  return _mm_or_ps(_mm_and_ps(mask.m, a.m), _mm_andnot_ps(mask.m, b.m));
+}
+
+inline float hmax(float4 a)
+{
+  __m128 m = _mm_max_ps(a.m, _mm_shuffle_ps(a.m, a.m, _MM_SHUFFLE(2, 3, 0, 1)));
+  m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+  return _mm_cvtss_f32(m);
+}
+
+inline float hsum(float4 a)
+{
+  __m128 m = _mm_add_ps(a.m, _mm_shuffle_ps(a.m, a.m, _MM_SHUFFLE(2, 3, 0, 1)));
+  m = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+  return _mm_cvtss_f32(m);
+}
+
+/// True if all lanes are equal to lane 0.
+inline bool all_equal(float4 a)
+{
+  __m128 first = _mm_shuffle_ps(a.m, a.m, _MM_SHUFFLE(0, 0, 0, 0));
+  return _mm_movemask_ps(_mm_cmpneq_ps(a.m, first)) == 0;
+}
+
+#else
+
+#define FLOAT4_LANEWISE(expr)                                                 \
+  float4 r;                                                                   \
+  for (int i = 0; i < 4; i++) r.f[i] = (expr);                                \
+  return r
+
+inline float4 operator+(float4 a, float4 b) { FLOAT4_LANEWISE(a.f[i] + b.f[i]); }
+inline float4 operator-(float4 a, float4 b) { FLOAT4_LANEWISE(a.f[i] - b.f[i]); }
+inline float4 operator*(float4 a, float4 b) { FLOAT4_LANEWISE(a.f[i] * b.f[i]); }
+inline float4 operator/(float4 a, float4 b) { FLOAT4_LANEWISE(a.f[i] / b.f[i]); }
+inline float4 min(float4 a, float4 b)
+{
+  FLOAT4_LANEWISE(b.f[i] < a.f[i] ? b.f[i] : a.f[i]);
+}
+inline float4 max(float4 a, float4 b)
+{
+  FLOAT4_LANEWISE(b.f[i] > a.f[i] ? b.f[i] : a.f[i]);
+}
+inline float4 abs(float4 a) { FLOAT4_LANEWISE(fabsf(a.f[i])); }
+inline float4 sqrt(float4 a) { FLOAT4_LANEWISE(sqrtf(a.f[i])); }
+inline float4 operator-(float4 a) { FLOAT4_LANEWISE(-a.f[i]); }
+inline float4 select(mask4 mask, float4 a, float4 b)
+{
+  FLOAT4_LANEWISE(mask.b[i] ? a.f[i] : b.f[i]);
+}
+
+#undef FLOAT4_LANEWISE
+
+#define MASK4_LANEWISE(expr)                                                  \
+  mask4 r;                                                                    \
+  for (int i = 0; i < 4; i++) r.b[i] = (expr);                                \
+  return r
+
+inline mask4 operator<(float4 a, float4 b) { MASK4_LANEWISE(a.f[i] < b.f[i]); }
+inline mask4 operator>(float4 a, float4 b) { MASK4_LANEWISE(a.f[i] > b.f[i]); }
+inline mask4 operator==(float4 a, float4 b) { MASK4_LANEWISE(a.f[i] == b.f[i]); }
+inline mask4 operator&(mask4 a, mask4 b) { MASK4_LANEWISE(a.b[i] && b.b[i]); }
+inline mask4 operator|(mask4 a, mask4 b) { MASK4_LANEWISE(a.b[i] || b.b[i]); }
+inline mask4 operator~(mask4 a) { MASK4_LANEWISE(!a.b[i]); }
+
+#undef MASK4_LANEWISE
+
+inline float hmax(float4 a)
+{
+  float m = a.f[0];
+  for (int i = 1; i < 4; i++) m = a.f[i] > m ? a.f[i] : m;
+  return m;
+}
+
+inline float hsum(float4 a) { return (a.f[0] + a.f[1]) + (a.f[2] + a.f[3]); }
+
+inline bool all_equal(float4 a)
+{
+  return a.f[1] == a.f[0] && a.f[2] == a.f[0] && a.f[3] == a.f[0];
+}
+
+#endif
+
+inline float4 operator*(float4 a, float c) { return a * float4(c); }
+
+/// Linear interpolation from `a` (t = 0) to `b` (t = 1).
+inline float4 lerp(float4 a, float4 b, float t)
+{
+  return a + (b - a) * float4(t);
+}
+
+/// There is no exponential instruction, so this is evaluated per lane.
+inline float4 exp(float4 a)
+{
+  return {expf(a[0]), expf(a[1]), expf(a[2]), expf(a[3])};
+}
+
+/// e^-a for a >= 0, to within 1e-5 relative. Meant for weights, where a
+/// polynomial beats four calls to expf.
+inline float4 exp_neg(float4 a)
+{
+#ifdef __SSE2__
+  // e^-a = 2^-i * e^-u, with i = round(a / ln 2) and |u| <= ln 2 / 2.
+  float4 t = min(a, float4(87.0f)) * 1.44269504f;
+  __m128i i = _mm_cvtps_epi32(t.m);
+  float4 u = (float4(_mm_cvtepi32_ps(i)) - t) * 0.693147181f;
+  float4 p = float4(1.0f) + u * (1.0f / 5);
+  p = float4(1.0f) + u * p * (1.0f / 4);
+  p = float4(1.0f) + u * p * (1.0f / 3);
+  p = float4(1.0f) + u * p * (1.0f / 2);
+  p = float4(1.0f) + u * p;
+  __m128i bits = _mm_sub_epi32(_mm_castps_si128(p.m), _mm_slli_epi32(i, 23));
+  return _mm_castsi128_ps(bits);
+#else
+  return {expf(-a[0]), expf(-a[1]), expf(-a[2]), expf(-a[3])};
+#endif
+}
+
+/// Make the calling thread treat denormal floats as zero. Arithmetic on them
+/// is very slow, and long products of small weights easily end up there.
+inline void flush_denormals()
+{
+#ifdef __SSE__
+  _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+  _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+#endif
+}
@@ -9,14 +9,16 @@ namespace skybox_ns {
 struct Solid final : public Skybox {
   Spectrum radiance;
   Solid(const Spectrum &radiance) : radiance(radiance) {}
-  float sample(const pupumath::vec3 &dir, float wavelen) override
+  SampledSpectrum sample(const pupumath::vec3 &dir,
+                         const SampledSpectrum &wavelens) override
   {
-    return radiance.sample(wavelen);
+    return radiance.sample(wavelens);
   }
 };
 
 struct Fancy final : public Skybox {
-  float sample(const pupumath::vec3 &dir, float wavelen) override
+  SampledSpectrum sample(const pupumath::vec3 &dir,
+                         const SampledSpectrum &wavelens) override
   {
     float theta = M_PI / 2 - acosf(dir.y);
     float phi = atan2f(dir.x, dir.z);
@@ -30,7 +32,7 @@ struct Fancy final : public Skybox {
       L = 6.0;
     // if (theta > 0*F) L = 1.0;
 
-    return L;
+    return SampledSpectrum(L);
     // return std::max(0.0f, sinf(phi*10));
     // return std::max(0.0f, dot(v, vec3(0,1,0)));
   }
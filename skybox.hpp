@@ -1,5 +1,6 @@
 #pragma once
 #include "pupumath_struct.hpp"
+#include "spectrum.hpp"
 #include <memory>
 
 class ValueBlock;
@@ -7,7 +8,8 @@ class ValueBlock;
 class Skybox {
 public:
   virtual ~Skybox() {}
-  virtual float sample(const pupumath::vec3 &dir, float wavelen) = 0;
+  virtual SampledSpectrum sample(const pupumath::vec3 &dir,
+                                 const SampledSpectrum &wavelens) = 0;
 };
 
 std::shared_ptr<Skybox> build_skybox(const ValueBlock &);
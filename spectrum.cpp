@@ -1,5 +1,6 @@
 #include "spectrum.hpp"
 #include "pupumath.hpp"
+#include <algorithm>
 #include <cmath>
 using namespace pupumath;
 
@@ -41,21 +42,75 @@ float yFit_1931(float wave)
 {
   float t1 = (wave - 568.8f) * ((wave < 568.8f) ? 0.0213f : 0.0247f);
   float t2 = (wave - 530.9f) * ((wave < 530.9f) ? 0.0613f : 0.0322f);
-  return 0.821f * exp(-0.5f * t1 * t1) + 0.286f * expf(-0.5f * t2 * t2);
+  return 0.821f * expf(-0.5f * t1 * t1) + 0.286f * expf(-0.5f * t2 * t2);
 }
 
 float zFit_1931(float wave)
 {
   float t1 = (wave - 437.0f) * ((wave < 437.0f) ? 0.0845f : 0.0278f);
   float t2 = (wave - 459.0f) * ((wave < 459.0f) ? 0.0385f : 0.0725f);
-  return 1.217f * exp(-0.5f * t1 * t1) + 0.681f * expf(-0.5f * t2 * t2);
+  return 1.217f * expf(-0.5f * t1 * t1) + 0.681f * expf(-0.5f * t2 * t2);
 }
 
+/// The color matching functions at 1 nm steps over the spectrum range, as
+/// XYZ and as linear RGB. Lookups interpolate linearly between entries.
+struct CieTable {
+  static constexpr int size = int(Spectrum::max - Spectrum::min) + 1;
+  float4 xyz[size];
+  float4 rgb[size];
+
+  CieTable()
+  {
+    for (int i = 0; i < size; i++) {
+      float wave = Spectrum::min + i;
+      vec3 x = {xFit_1931(wave), yFit_1931(wave), zFit_1931(wave)};
+      vec3 c = xyz_to_linear_rgb(x);
+      xyz[i] = float4(x.x, x.y, x.z, 0.0f);
+      rgb[i] = float4(c.x, c.y, c.z, 0.0f);
+    }
+  }
+
+  /// Entry and interpolation weight for `wavelength`.
+  static int locate(float wavelength, float& t)
+  {
+    float pos = wavelength - Spectrum::min;
+    pos = std::min(std::max(pos, 0.0f), float(size - 1));
+    int i = std::min(int(pos), size - 2);
+    t = pos - i;
+    return i;
+  }
+};
+
+static const CieTable cie_table;
+
 vec3 spectrum_sample_to_xyz(float wavelength, float amplitude)
 {
-  return vec3{amplitude * xFit_1931(wavelength),
-              amplitude * yFit_1931(wavelength),
-              amplitude * zFit_1931(wavelength)};
+  float t;
+  int i = CieTable::locate(wavelength, t);
+  float4 v = lerp(cie_table.xyz[i], cie_table.xyz[i + 1], t) * amplitude;
+  return vec3{v[0], v[1], v[2]};
+}
+
+vec3 spectrum_sample_to_xyz(const SampledSpectrum& wavelengths,
+                            const SampledSpectrum& amplitudes)
+{
+  return linear_rgb_to_xyz(
+      spectrum_sample_to_linear_rgb(wavelengths, amplitudes));
+}
+
+vec3 spectrum_sample_to_linear_rgb(const SampledSpectrum& wavelengths,
+                                   const SampledSpectrum& amplitudes)
+{
+  float4 acc(0.0f);
+  for (int k = 0; k < SampledSpectrum::lanes; k++) {
+    float t;
+    int i = CieTable::locate(wavelengths[k], t);
+    float4 a = cie_table.rgb[i];
+    float4 b = cie_table.rgb[i + 1];
+    acc = acc + (a + (b - a) * t) * amplitudes[k];
+  }
+  acc = acc * (1.0f / SampledSpectrum::lanes);
+  return vec3{acc[0], acc[1], acc[2]};
 }
 
 vec3 xyz_to_linear_rgb(const vec3& xyz)
@@ -96,13 +151,13 @@ std::array<float, Spectrum::count> linear_rgb_to_spectrum(const vec3& rgb)
   //
   // Modified to use automatically calculated spectrum curves.
 #if 1
-  static float white_spectrum[Spectrum::count];
-  static float red_spectrum[Spectrum::count];
-  static float yellow_spectrum[Spectrum::count];
-  static float green_spectrum[Spectrum::count];
-  static float cyan_spectrum[Spectrum::count];
-  static float blue_spectrum[Spectrum::count];
-  static float magenta_spectrum[Spectrum::count];
+  static Spectrum white_spectrum;
+  static Spectrum red_spectrum;
+  static Spectrum yellow_spectrum;
+  static Spectrum green_spectrum;
+  static Spectrum cyan_spectrum;
+  static Spectrum blue_spectrum;
+  static Spectrum magenta_spectrum;
   static bool inited = false;
 
   if (!inited) {
@@ -110,13 +165,13 @@ std::array<float, Spectrum::count> linear_rgb_to_spectrum(const vec3& rgb)
       int wavelen =
           Spectrum::min + (Spectrum::max - Spectrum::min) / Spectrum::count;
       vec3 rgb_ = xyz_to_linear_rgb(spectrum_sample_to_xyz(wavelen, 1));
-      white_spectrum[i] = rgb_[0] + rgb_[1] + rgb_[2];
-      red_spectrum[i] = rgb_[0];
-      yellow_spectrum[i] = rgb_[0] + rgb_[1];
-      green_spectrum[i] = rgb_[1];
-      cyan_spectrum[i] = rgb_[1] + rgb_[2];
-      blue_spectrum[i] = rgb_[2];
-      magenta_spectrum[i] = rgb_[2] + rgb_[3];
+      white_spectrum.samples[i] = rgb_[0] + rgb_[1] + rgb_[2];
+      red_spectrum.samples[i] = rgb_[0];
+      yellow_spectrum.samples[i] = rgb_[0] + rgb_[1];
+      green_spectrum.samples[i] = rgb_[1];
+      cyan_spectrum.samples[i] = rgb_[1] + rgb_[2];
+      blue_spectrum.samples[i] = rgb_[2];
+      magenta_spectrum.samples[i] = rgb_[2] + rgb_[3];
     }
     inited = true;
   }
@@ -138,17 +193,14 @@ std::array<float, Spectrum::count> linear_rgb_to_spectrum(const vec3& rgb)
       1, 1, .9685, .2229, 0, 0.0458, 0.8369, 1, 1, 0.9959};
 #endif
 
-  std::array<float, Spectrum::count> spectrum;
-  spectrum.fill(0);
+  Spectrum spectrum(0.0f);
 
   float r = rgb[0];
   float g = rgb[1];
   float b = rgb[2];
 
-  auto add = [&spectrum](float scl, float* src) {
-    for (int i = 0; i < Spectrum::count; i++) {
-      spectrum[i] += scl * src[i];
-    }
+  auto add = [&spectrum](float scl, const Spectrum& src) {
+    spectrum += scl * src;
   };
 
   if (r < g && r < b) {
@@ -185,7 +237,7 @@ std::array<float, Spectrum::count> linear_rgb_to_spectrum(const vec3& rgb)
     }
   }
 
-  return spectrum;
+  return spectrum.samples;
 }
 
 } // namespace_ns
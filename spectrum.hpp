@@ -1,7 +1,57 @@
 #pragma once
 #include "pupumath_struct.hpp"
+#include "simd.hpp"
 #include <array>
 
+/// Values of a spectral quantity at the few wavelengths that are traced
+/// together along one path. Also used to hold those wavelengths.
+struct SampledSpectrum {
+  static constexpr int lanes = 4;
+  float4 v;
+
+  SampledSpectrum() {}
+  SampledSpectrum(float4 v) : v(v) {}
+  explicit SampledSpectrum(float c) : v(c) {}
+
+  float& operator[](int i) { return v[i]; }
+  float operator[](int i) const { return v[i]; }
+
+  SampledSpectrum& operator+=(const SampledSpectrum& o)
+  {
+    v = v + o.v;
+    return *this;
+  }
+  SampledSpectrum& operator*=(const SampledSpectrum& o)
+  {
+    v = v * o.v;
+    return *this;
+  }
+  SampledSpectrum& operator*=(float c)
+  {
+    v = v * c;
+    return *this;
+  }
+  SampledSpectrum& operator/=(float c) { return *this *= 1 / c; }
+
+  float max_value() const { return hmax(v); }
+
+  /// True if all lanes hold the same value.
+  bool is_constant() const { return all_equal(v); }
+};
+
+inline SampledSpectrum operator+(SampledSpectrum a, const SampledSpectrum& b)
+{
+  return a += b;
+}
+inline SampledSpectrum operator*(SampledSpectrum a, const SampledSpectrum& b)
+{
+  return a *= b;
+}
+inline SampledSpectrum operator*(SampledSpectrum a, float c) { return a *= c; }
+inline SampledSpectrum operator*(float c, SampledSpectrum a) { return a *= c; }
+inline SampledSpectrum operator/(SampledSpectrum a, float c) { return a /= c; }
+inline SampledSpectrum exp(const SampledSpectrum& a) { return exp(a.v); }
+
 struct Spectrum {
   static constexpr float min = 400;
   static constexpr float max = 700;
@@ -9,7 +59,13 @@ struct Spectrum {
   static constexpr float count_over_max_minus_min = count / (max - min);
   static constexpr float wavelen(float f) { return min + (max - min) * f; }
 
-  std::array<float, count> samples;
+  static constexpr int chunks = count / 4;
+  static_assert(count % 4 == 0, "samples are processed four at a time");
+
+  alignas(16) std::array<float, count> samples;
+
+  float4 chunk(int i) const { return float4::load(&samples[4 * i]); }
+  void set_chunk(int i, float4 c) { c.store(&samples[4 * i]); }
 
   float sample(float wavelen) const
   {
@@ -17,13 +73,97 @@ struct Spectrum {
     return samples[int((wavelen - min) * count_over_max_minus_min)];
   }
 
+  SampledSpectrum sample(const SampledSpectrum& wavelens) const
+  {
+    // Bin positions for all lanes at once, then one load per lane.
+    float4 pos = (wavelens.v - float4(min)) * count_over_max_minus_min;
+    SampledSpectrum result;
+    for (int i = 0; i < SampledSpectrum::lanes; i++) {
+      result[i] = pos[i] >= 0 && pos[i] < count ? samples[int(pos[i])] : 0.0f;
+    }
+    return result;
+  }
+
+  /// Wavelengths to trace along with the hero wavelength `hero`, which goes
+  /// in lane 0. The others are spaced evenly over the range, wrapping
+  /// around, so that each of them is uniformly distributed too.
+  static SampledSpectrum wavelens(float hero)
+  {
+    constexpr float step = (max - min) / SampledSpectrum::lanes;
+    SampledSpectrum result;
+    for (int i = 0; i < SampledSpectrum::lanes; i++) {
+      float w = hero + i * step;
+      result[i] = w >= max ? w - (max - min) : w;
+    }
+    return result;
+  }
+
   Spectrum() {}
   Spectrum(const pupumath::vec3& linear_rgb);
   Spectrum(float v) { samples.fill(v); }
 };
 
+// Whole spectrum arithmetic, four samples at a time.
+
+inline Spectrum operator+(const Spectrum& a, const Spectrum& b)
+{
+  Spectrum r;
+  for (int i = 0; i < Spectrum::chunks; i++) r.set_chunk(i, a.chunk(i) + b.chunk(i));
+  return r;
+}
+
+inline Spectrum operator*(const Spectrum& a, const Spectrum& b)
+{
+  Spectrum r;
+  for (int i = 0; i < Spectrum::chunks; i++) r.set_chunk(i, a.chunk(i) * b.chunk(i));
+  return r;
+}
+
+inline Spectrum operator*(const Spectrum& a, float c)
+{
+  Spectrum r;
+  for (int i = 0; i < Spectrum::chunks; i++) r.set_chunk(i, a.chunk(i) * c);
+  return r;
+}
+
+inline Spectrum operator*(float c, const Spectrum& a) { return a * c; }
+
+inline Spectrum& operator+=(Spectrum& a, const Spectrum& b) { return a = a + b; }
+
+inline Spectrum lerp(const Spectrum& a, const Spectrum& b, float t)
+{
+  Spectrum r;
+  for (int i = 0; i < Spectrum::chunks; i++) {
+    r.set_chunk(i, lerp(a.chunk(i), b.chunk(i), t));
+  }
+  return r;
+}
+
+inline Spectrum exp(const Spectrum& a)
+{
+  Spectrum r;
+  for (int i = 0; i < Spectrum::chunks; i++) r.set_chunk(i, exp(a.chunk(i)));
+  return r;
+}
+
+inline float dot(const Spectrum& a, const Spectrum& b)
+{
+  float4 acc(0.0f);
+  for (int i = 0; i < Spectrum::chunks; i++) acc = acc + a.chunk(i) * b.chunk(i);
+  return hsum(acc);
+}
+
+inline float sum(const Spectrum& a) { return dot(a, Spectrum(1.0f)); }
+
 namespace spectrum_ns {
 pupumath::vec3 spectrum_sample_to_xyz(float wavelength, float amplitude);
+/// Average of the XYZ contributions of all lanes.
+pupumath::vec3 spectrum_sample_to_xyz(const SampledSpectrum& wavelengths,
+                                      const SampledSpectrum& amplitudes);
+/// Same as converting the above to linear RGB, with a single table lookup per
+/// lane.
+pupumath::vec3 spectrum_sample_to_linear_rgb(const SampledSpectrum& wavelengths,
+                                             const SampledSpectrum& amplitudes);
 pupumath::vec3 xyz_to_linear_rgb(const pupumath::vec3& xyz);
 pupumath::vec3 linear_rgb_to_xyz(const pupumath::vec3& rgb);
 pupumath::vec3 srgb_to_xyz(pupumath::vec3 rgb);
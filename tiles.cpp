@@ -0,0 +1,58 @@
+#include "tiles.hpp"
+#include <algorithm>
+#include <cassert>
+
+std::vector<Tile> make_tiles(int xres, int yres, int tile_size)
+{
+  assert(tile_size >= 1);
+  std::vector<Tile> tiles;
+  for (int y = 0; y < yres; y += tile_size) {
+    for (int x = 0; x < xres; x += tile_size) {
+      tiles.push_back({static_cast<int>(tiles.size()), x, y,
+                       std::min(x + tile_size, xres),
+                       std::min(y + tile_size, yres)});
+    }
+  }
+  return tiles;
+}
+
+TileScheduler::TileScheduler(const std::vector<Tile>& tiles, int workers)
+{
+  size_t n = tiles.size();
+  for (int i = 0; i < workers; i++) {
+    queues.emplace_back(new Queue);
+    queues.back()->tiles.assign(tiles.begin() + n * i / workers,
+                                tiles.begin() + n * (i + 1) / workers);
+  }
+}
+
+bool TileScheduler::pop_front(Queue& queue, Tile& tile)
+{
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.tiles.empty()) return false;
+  tile = queue.tiles.front();
+  queue.tiles.pop_front();
+  return true;
+}
+
+bool TileScheduler::pop_back(Queue& queue, Tile& tile)
+{
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.tiles.empty()) return false;
+  tile = queue.tiles.back();
+  queue.tiles.pop_back();
+  return true;
+}
+
+bool TileScheduler::next(int worker, Tile& tile)
+{
+  if (pop_front(*queues[worker], tile)) return true;
+
+  // Own queue is empty, try to steal from the others. Start from the
+  // neighbour so that idle workers don't all hammer the same victim.
+  int n = queues.size();
+  for (int i = 1; i < n; i++) {
+    if (pop_back(*queues[(worker + i) % n], tile)) return true;
+  }
+  return false;
+}
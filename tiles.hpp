@@ -0,0 +1,39 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/// Rectangular region of the image [x0, x1) x [y0, y1).
+struct Tile {
+  int index;
+  int x0, y0, x1, y1;
+};
+
+/// Tiles covering the image in rows. `tile_size` must be at least 1.
+std::vector<Tile> make_tiles(int xres, int yres, int tile_size);
+
+/// Hands out tiles to a fixed number of workers.
+///
+/// Every worker owns a deque that is initially filled with a contiguous run of
+/// tiles. A worker takes tiles from the front of its own deque and, once it
+/// runs dry, steals from the back of the other workers' deques. The deques are
+/// only touched once per tile, so a plain mutex per deque is cheap enough.
+class TileScheduler {
+public:
+  TileScheduler(const std::vector<Tile>& tiles, int workers);
+
+  /// Fetch the next tile for `worker`. Returns false when all tiles are done.
+  bool next(int worker, Tile& tile);
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Tile> tiles;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues;
+
+  bool pop_front(Queue& queue, Tile& tile);
+  bool pop_back(Queue& queue, Tile& tile);
+};
@@ -1,15 +1,60 @@
 #pragma once
 
 #include "pupumath.hpp"
+#include <algorithm>
 #include <cmath>
-#include <cstdlib>
+#include <cstdint>
 #include <tuple>
+#include <vector>
 
-inline float frand()
-{
-  // FIXME: use c++ rng facilities
-  return static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
-}
+/// PCG32 random number generator (O'Neill, http://www.pcg-random.org). The
+/// state is small enough to give every pixel and path its own generator, so
+/// results don't depend on how the work is split between threads.
+class Pcg32 {
+public:
+  explicit Pcg32(uint64_t seed = 0, uint64_t stream = 0) { set_seed(seed, stream); }
+
+  void set_seed(uint64_t seed, uint64_t stream)
+  {
+    state = 0;
+    inc = (stream << 1) | 1;
+    next();
+    state += seed;
+    next();
+  }
+
+  uint32_t next()
+  {
+    uint64_t old = state;
+    state = old * 6364136223846793005ull + inc;
+    uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+    uint32_t rot = old >> 59;
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+  }
+
+  /// Uniform float in [0, 1).
+  float uniform() { return (next() >> 8) * (1.0f / (1 << 24)); }
+
+  /// Uniform int in [0, n).
+  int uniform_int(int n)
+  {
+    // Lemire's multiply and shift with rejection of the biased low range.
+    uint64_t m = uint64_t(next()) * uint32_t(n);
+    uint32_t low = uint32_t(m);
+    if (low < uint32_t(n)) {
+      uint32_t threshold = -uint32_t(n) % uint32_t(n);
+      while (low < threshold) {
+        m = uint64_t(next()) * uint32_t(n);
+        low = uint32_t(m);
+      }
+    }
+    return int(m >> 32);
+  }
+
+private:
+  uint64_t state;
+  uint64_t inc;
+};
 
 inline pupumath::mat3 basis_from_normal(const pupumath::vec3 &normal)
 {
@@ -76,3 +121,57 @@ inline pupumath::vec3 sample_hemisphere_cosine(float u1, float u2)
 
 inline float cos_theta(const pupumath::vec3 &v) { return v.z; }
 inline float abs_cos_theta(const pupumath::vec3 &v) { return fabs(v.z); }
+
+inline pupumath::vec3 sample_sphere(float u1, float u2)
+{
+  float z = 1 - 2 * u1;
+  float r = sqrtf(std::max(0.0f, 1 - z * z));
+  float phi = 2 * M_PI * u2;
+  return pupumath::vec3(r * cos(phi), r * sin(phi), z);
+}
+
+/// Uniformly distributed point on a triangle.
+inline pupumath::vec3 sample_triangle(float u1, float u2,
+                                      const pupumath::vec3 &v0,
+                                      const pupumath::vec3 &v1,
+                                      const pupumath::vec3 &v2)
+{
+  float su = sqrtf(u1);
+  float b0 = 1 - su;
+  float b1 = u2 * su;
+  return v0 * b0 + v1 * b1 + v2 * (1 - b0 - b1);
+}
+
+/// Discrete distribution proportional to a list of non-negative weights.
+class Distribution1D {
+public:
+  Distribution1D() {}
+  Distribution1D(const std::vector<float> &weights) : cdf(weights.size() + 1)
+  {
+    cdf[0] = 0;
+    for (size_t i = 0; i < weights.size(); i++) {
+      cdf[i + 1] = cdf[i] + weights[i];
+    }
+  }
+
+  size_t size() const { return cdf.empty() ? 0 : cdf.size() - 1; }
+  float total() const { return cdf.empty() ? 0 : cdf.back(); }
+
+  float pdf(int i) const { return (cdf[i + 1] - cdf[i]) / total(); }
+
+  /// Pick an entry for `u` in [0, 1). `u` is remapped to [0, 1) within the
+  /// chosen entry so that it can be used again.
+  int sample(float &u, float &pdf) const
+  {
+    float target = u * total();
+    int i = std::upper_bound(cdf.begin() + 1, cdf.end() - 1, target) -
+            (cdf.begin() + 1);
+    float width = cdf[i + 1] - cdf[i];
+    u = std::min((target - cdf[i]) / width, 0.99999994f);
+    pdf = width / total();
+    return i;
+  }
+
+private:
+  std::vector<float> cdf;
+};